@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sectors are cached in RAM, keyed by drive and LBA, and thrown out
+// least recently used first. Writes only go to the cache; dirty
+// sectors are written back when they're evicted or on bcacheSync.
+#define BCACHE_BLOCK_SIZE   512
+#define BCACHE_BUFFER_COUNT 256
+
+// Sequential reads pull in up to this many sectors past what was asked
+// for. A full window plus a full read has to fit in the cache.
+#define BCACHE_MAX_READAHEAD 128
+
+void bcacheInit();
+
+// Copies sectors out of the cache, reading the ones that aren't there
+// from the drive. Returns false if the drive couldn't be read.
+bool bcacheRead(uint8_t drive, uint32_t sector, uint32_t num_sectors, void* data);
+// Copies sectors into the cache and marks them dirty. Returns false if
+// there was no room, because every buffer is dirty and none of them
+// can be written back.
+bool bcacheWrite(uint8_t drive, uint32_t sector, uint32_t num_sectors, const void* data);
+// Drops any cached copies of the sectors, dirty or not. For callers
+// about to overwrite them through the block layer directly.
+void bcacheInvalidate(uint8_t drive, uint32_t sector, uint32_t num_sectors);
+// Writes back any dirty cached copies of the sectors and drops them
+// all, for callers about to read them through the block layer
+// directly. Returns false if a dirty one couldn't be written back.
+bool bcacheEvict(uint8_t drive, uint32_t sector, uint32_t num_sectors);
+// Writes every dirty sector back to its drive and flushes the drives'
+// caches, so everything written before this is durable. Returns false
+// if any of it didn't make it, including write-backs from evictions
+// that failed since the last sync. Those sectors stay dirty, or stay
+// queued in the block layer, for the next try.
+bool bcacheSync();
+
+// Sets the most sectors a sequential reader can have read ahead for it.
+// 0 turns read-ahead off.
+void bcacheSetReadAhead(uint32_t max_sectors);
+uint32_t bcacheGetReadAhead();
+
+void bcacheDump();
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <ide.h>
+
+// Requests for a drive are queued up, merged where they touch and
+// only sent to the drive when the queue is unplugged, sorted by LBA so
+// the heads sweep across the disk once instead of seeking back and
+// forth.
+#define BLOCK_QUEUE_DEPTH 32
+
+typedef struct {
+    uint32_t submitted;
+    uint32_t merged;             // Requests folded into a neighbour
+    uint32_t dispatched;         // Commands actually sent to the drive
+    uint32_t sectors_dispatched;
+    uint32_t unplugs;
+    uint32_t flushes;            // Cache flushes actually sent
+    uint32_t failed;             // Commands the drive failed
+    uint32_t dropped;            // Writes given up on after failing too often
+} BlockQueueStats;
+
+void blockInit();
+
+// Queues a read. `buffer` is only filled once the queue is unplugged,
+// and `succeeded` (if not NULL) says whether it was. Making room can
+// mean unplugging the queue, and if that fails the read isn't queued
+// and this returns false.
+bool blockSubmitRead(uint8_t drive, char* buffer, uint32_t sector, uint32_t num_sectors, bool* succeeded);
+// Queues a write. The data is copied, so `buffer` can be reused as
+// soon as this returns. Returns false, without queueing it, if making
+// room for it failed.
+bool blockSubmitWrite(uint8_t drive, const char* buffer, uint32_t sector, uint32_t num_sectors);
+// Sends everything queued for `drive` to it. Returns false if any of
+// the transfers failed. Failed writes stay queued and are tried again
+// at the next unplug, up to a few times. After that they're dropped,
+// and the unplug that drops them is the last to report them.
+bool blockUnplug(uint8_t drive);
+// Same for every drive. Drives on different channels are served at the
+// same time.
+bool blockUnplugAll();
+// Barrier: sends everything queued for `drive`, then has the drive
+// flush its write cache, so every write submitted before this call is
+// durable once it returns. Writes on their own are only as durable as
+// the drive's cache.
+bool blockFlush(uint8_t drive);
+bool blockFlushAll();
+
+// Reads straight away (along with anything else that was queued).
+// Returns whether this read worked, whatever happened to the others.
+bool blockRead(uint8_t drive, char* buffer, uint32_t sector, uint32_t num_sectors);
+// Writes are held in the queue until something unplugs it
+bool blockWrite(uint8_t drive, const char* buffer, uint32_t sector, uint32_t num_sectors);
+
+BlockQueueStats blockGetStats(uint8_t drive);
+void blockDumpStats();
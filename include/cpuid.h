@@ -7,6 +7,7 @@
 
 void cpuidPrintVendor();
 void loadCpuid();
+bool cpuidHasGlobalPages();
 void cpuidLoadFeatures(intptr_t, intptr_t);
 
 #endif
@@ -22,7 +22,33 @@ BAR4 + 8 is the Base of 8 I/O ports controls secondary channel's Bus Master IDE.
 
 #define IDE_SECTOR_SIZE 512
 
+// Master and slave on each of the primary and secondary channels:
+// 0 and 1 are the primary master and slave, 2 and 3 the secondary
+#define ATA_MAX_CHANNELS 2
+#define ATA_MAX_DRIVES   (ATA_MAX_CHANNELS * 2)
+
 bool ideInit ();
-void ideIRQHandler();
+void ideIRQHandler(uint32_t channel);
 uint32_t ideWrite(char* data, uint32_t num_sectors, uint32_t sector_num);
 
+int32_t ataRead(char* data, uint32_t num_sectors, uint32_t sector_num);
+int32_t ataWrite(char* data, uint32_t num_sectors, uint32_t sector_num);
+int32_t ataDriveRead(uint8_t drive, char* data, uint32_t num_sectors, uint32_t sector_num);
+int32_t ataDriveWrite(uint8_t drive, char* data, uint32_t num_sectors, uint32_t sector_num);
+// Writes are left in the drive's cache until this is called
+bool ataDriveFlush(uint8_t drive);
+
+bool ataDrivePresent(uint8_t drive);
+uint32_t ataDriveSectors(uint8_t drive);
+// Drives on different channels can have transfers in flight at once
+uint8_t ataDriveChannel(uint8_t drive);
+// Starts a transfer without waiting for it, if it fits in one DMA
+// command. Anything else is done straight away. Either way the
+// channel is busy until ataDriveFinishTransfer, which returns whether
+// the transfer succeeded.
+void ataDriveStartTransfer(uint8_t drive, char* data, uint32_t num_sectors, uint32_t sector_num, bool write);
+bool ataDriveFinishTransfer(uint8_t drive);
+
+// Times PIO and DMA reads from the start of the drive
+void ataBenchmark(uint8_t drive);
+
@@ -24,3 +24,6 @@ void idtInit();
 void idt_add_isr(uint8_t id, void (*isr)(), uint8_t desc_level, uint8_t type);
 void addIsrToIdt(uint8_t id, void (*isr)(), int desc_level, int type);
 
+// Masks or unmasks a single IRQ line (0-15) on the PICs
+void irqSetMask(uint8_t irq_line);
+void irqClearMask(uint8_t irq_line);
@@ -66,6 +66,36 @@ static inline void inl_mem(uint16_t port, uint32_t* mem) {
     *mem = ret;
 }
 
+/* String I/O: moves `count` items between a port and memory with a
+ * single rep instruction, instead of one in/out per item */
+static inline void insw(uint16_t port, void* mem, size_t count) {
+	__asm__ volatile ( "rep insw"
+                      : "+D"(mem), "+c"(count)
+                      : "d"(port)
+                      : "memory" );
+}
+
+static inline void outsw(uint16_t port, const void* mem, size_t count) {
+	__asm__ volatile ( "rep outsw"
+                      : "+S"(mem), "+c"(count)
+                      : "d"(port)
+                      : "memory" );
+}
+
+static inline void insl(uint16_t port, void* mem, size_t count) {
+	__asm__ volatile ( "rep insl"
+                      : "+D"(mem), "+c"(count)
+                      : "d"(port)
+                      : "memory" );
+}
+
+static inline void outsl(uint16_t port, const void* mem, size_t count) {
+	__asm__ volatile ( "rep outsl"
+                      : "+S"(mem), "+c"(count)
+                      : "d"(port)
+                      : "memory" );
+}
+
 static inline void ioWait(void) {
 	__asm__ volatile ( "jmp 1f\n\t"
 					"1: jmp 2f\n\t"
@@ -1,7 +1,10 @@
 #pragma once
 
-#define KHEAP_START 0xf000000
-#define KHEAP_END   0xfffffff
+#include <stddef.h>
+
+#define KHEAP_START      0xf000000
+#define KHEAP_SLAB_START 0xfc00000 // Top 4 MiB of the heap is handed out as slabs
+#define KHEAP_END        0xfffffff
 
 void  kheapInit();
 void* kheapAlloc(size_t size);
@@ -9,3 +12,4 @@ void* kheapAlignedAlloc(size_t size, size_t alignment);
 void* kheapRealloc(void* ptr, size_t size);
 void  kheapFree(void* ptr);
 void  kheapDump();
+void  kheapBenchmark();
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Small allocations (up to KSLAB_MAX_OBJECT_SIZE bytes) are served
+// by per-size-class slab caches living in the top of the kernel heap
+// (KHEAP_SLAB_START to KHEAP_END). Everything bigger goes through
+// the regular heap node list. kheapAlloc/kheapFree dispatch between
+// the two, so most code never needs to call these directly.
+
+#define KSLAB_MIN_OBJECT_SIZE 16
+#define KSLAB_MAX_OBJECT_SIZE 2048
+
+void   kslabInit();
+void*  kslabAlloc(size_t size);
+void   kslabFree(void* ptr);
+bool   kslabOwns(void* ptr);
+size_t kslabObjectSize(void* ptr);
+void   kslabDump();
@@ -1,9 +1,17 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#define PAGE_SIZE 4096
+
+// Frames are allocated in blocks of 2^order 4 KiB frames, from a
+// single frame up to a whole 4 MiB
+#define MAX_FRAME_ORDER 10
+
 typedef uint32_t PageDirEntry;
+typedef uint32_t PageTableEntry;
 
 typedef struct {
     uint32_t flags;     // 0
@@ -29,3 +37,14 @@ typedef struct {
 
 void loadPhysicalMemoryRegionDescriptors(MultibootInfo* multiboot_info);
 void setupPaging();
+void physicalMemoryDump();
+
+uint32_t allocFrames(uint32_t order);
+void     freeFrames(uint32_t address, uint32_t order);
+
+void mapFreshPage(uint32_t virtual_address);
+void unmapPage(uint32_t virtual_address);
+bool isPageMapped(uint32_t virtual_address);
+uint32_t virtualToPhysical(uint32_t virtual_address);
+void tlbBatchBegin();
+void tlbBatchEnd();
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 struct pci_device {
 	uint8_t  bus;
@@ -26,6 +27,13 @@ struct pci_device {
 typedef struct pci_device PCIDevice;
 
 uint16_t pciConfigReadWord (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint32_t pciConfigReadLong (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pciConfigWriteLong (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+
+PCIDevice pciGetDevice(uint8_t bus, uint8_t device, uint8_t function);
+uint32_t pciReadBar(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar_num);
+void pciEnableBusMastering(PCIDevice pd);
+bool pciFindDevice(uint8_t class_code, uint8_t sub_class, PCIDevice* found);
 
 void pciCheckFunction(uint8_t bus, uint8_t device, uint8_t func);
 void pciCheckDevice(uint8_t bus, uint8_t device);
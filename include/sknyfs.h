@@ -5,8 +5,41 @@
  *
  */
 
+#include <stdint.h>
+
+typedef struct SknyDirectory SknyDirectory;
+typedef struct SknyFile SknyFile;
+typedef struct SknyJournal SknyJournal;
+typedef struct SknySuperblock SknySuperblock;
+
+// Chunks are the unit files are allocated in. Big chunks suit volumes
+// of big files, which then stream in long runs; small chunks waste less
+// space on small files. Must be a power of two from IDE_SECTOR_SIZE up
+// to SKNY_MAX_CHUNK_SIZE.
+#define SKNY_DEFAULT_CHUNK_SIZE (16 * 1024)
+#define SKNY_MAX_CHUNK_SIZE     (64 * 1024)
+#define SKNY_DEFAULT_FILE_COUNT 1024
+// The allocation map is kept in memory, so it has a limit. That's
+// 512K chunks: 512 MiB of 1 KiB chunks, or 8 GiB of 16 KiB ones.
+#define SKNY_MAX_ALLOCATION_MAP_SIZE (64 * 1024)
+
 typedef struct {
     uint8_t drive;
+    // Chunk size and where the maps and the journal are, read at mount
+    SknySuperblock* superblock;
+    // The allocation map, loaded at mount and kept in step with the
+    // disk, one bit per chunk
+    uint32_t* allocation_map;
+    // The allocation map as of the last commit. Chunks freed since then
+    // aren't handed out until the next one, since until then a crash
+    // gives them back to the file that had them.
+    uint32_t* committed_map;
+    // Where the next search for a free chunk starts
+    uint32_t next_fit;
+    // Name index over the file map, rebuilt at mount
+    SknyDirectory* directory;
+    // Metadata changes not committed yet
+    SknyJournal* journal;
 } SknyHandle;
 
 typedef enum {
@@ -14,10 +47,47 @@ typedef enum {
     SKNY_WRITE_FAILURE,
     SKNY_READ_FAILURE,
     SKNY_FILESYSTEM_FULL,
-    SKNY_FILE_NOT_FOUND
+    SKNY_FILE_NOT_FOUND,
+    SKNY_FILE_TOO_FRAGMENTED, // Needs more extents than its metadata holds
+    SKNY_BAD_POSITION,        // Seek past the end of the file
+    SKNY_BAD_SUPERBLOCK       // Not SknyFS, or a layout we can't use
 } SknyStatus;
 
 extern const char* sknyStatusToString(SknyStatus status);
 
-SknyStatus sknyCreateFilesystem(SknyHandle* handle, uint8_t drive);
+// Formats the drive and leaves it mounted on `handle`. The file map
+// gets room for at least `file_count` files. Only as much of the drive
+// as the allocation map can track in SKNY_MAX_ALLOCATION_MAP_SIZE bytes
+// is used.
+SknyStatus sknyCreateFilesystem(SknyHandle* handle, uint8_t drive, uint32_t chunk_size, uint32_t file_count);
+SknyStatus sknyMount(SknyHandle* handle, uint8_t drive);
+// Metadata changes are batched in a journal transaction, and are only
+// crash-safe once it's committed. That happens when it fills up, on
+// sknySync, and on sknyUnmount.
+SknyStatus sknySync(SknyHandle* handle);
+// Writes everything back and lets go of the handle's memory
+SknyStatus sknyUnmount(SknyHandle* handle);
+void sknyDumpJournal(SknyHandle* handle);
+// Times a format of the drive. Destroys anything on it.
+void sknyFormatBenchmark(uint8_t drive, uint32_t chunk_size);
 SknyStatus sknyCreateFile(SknyHandle* handle, const char* name);
+// Replaces the file's contents with `size` bytes of `data`
+SknyStatus sknyWriteFile(SknyHandle* handle, const char* name, const void* data, uint32_t size);
+// Reads up to `buffer_size` bytes from the start of the file
+SknyStatus sknyReadFile(SknyHandle* handle, const char* name, void* buffer, uint32_t buffer_size, uint32_t* size_read);
+
+// Streaming access. Each open file has its own position and a one
+// chunk staging buffer, so sequential writes reach the disk a whole
+// chunk at a time. Changes may sit in the handle until sknyFlush or
+// sknyClose. Don't mix these with sknyWriteFile on the same file.
+SknyStatus sknyOpen(SknyHandle* handle, const char* name, SknyFile** ret);
+// Reads from the current position, stopping at the end of the file
+SknyStatus sknyRead(SknyFile* file, void* buffer, uint32_t count, uint32_t* count_read);
+// Writes at the current position, growing the file as needed
+SknyStatus sknyWrite(SknyFile* file, const void* data, uint32_t count);
+// Positions can be anywhere up to the end of the file
+SknyStatus sknySeek(SknyFile* file, uint32_t position);
+uint32_t sknyTell(SknyFile* file);
+uint32_t sknyFileSize(SknyFile* file);
+SknyStatus sknyFlush(SknyFile* file);
+SknyStatus sknyClose(SknyFile* file);
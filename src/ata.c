@@ -87,8 +87,10 @@ BAR4 + 8 is the Base of 8 I/O ports controls secondary channel's Bus Master IDE.
 #define ATA_IDENT_COMMANDSETS  164
 #define ATA_IDENT_MAX_LBA_EXT  200
 
-#define ATA_PRIMARY_SELECT     0xE0
-#define ATA_SECONDARY_SELECT     0xF0
+// Drive select values with the LBA bit set. The low nibble holds the
+// top bits of an LBA28 address.
+#define ATA_MASTER_SELECT     0xE0
+#define ATA_SLAVE_SELECT      0xF0
 
 /* ===== Interface Types ===== */
 #define IDE_ATA        0x00
@@ -125,12 +127,13 @@ BAR4 + 8 is the Base of 8 I/O ports controls secondary channel's Bus Master IDE.
 
 #define BMIDE_REG_COMMAND   0x0
 #define BMIDE_REG_STATUS    0x2
+#define BMIDE_REG_PRDT      0x4
 
-#define BMIDE_RW        1<<3
-#define BMIDE_ERROR_BIT 1<<1
-#define BMIDE_INTERRUPT 1<<2
-#define BMIDE_ACTIVE    1<<0
-#define BMIDE_START_STOP 1<<0
+#define BMIDE_RW        (1<<3)
+#define BMIDE_ERROR_BIT (1<<1)
+#define BMIDE_INTERRUPT (1<<2)
+#define BMIDE_ACTIVE    (1<<0)
+#define BMIDE_START_STOP (1<<0)
 
 #define NUM_IDE_CHANNELS    2   // This should be constant
 #define SECTOR_SIZE   512
@@ -142,6 +145,9 @@ BAR4 + 8 is the Base of 8 I/O ports controls secondary channel's Bus Master IDE.
 #include <kheap.h>
 #include <io.h>
 #include <ide.h>
+#include <idt.h>
+#include <memory.h>
+#include <pci.h>
 #include <timer.h>
 
 typedef struct {
@@ -183,15 +189,73 @@ typedef struct {
     uint16_t command_port;
     bool uses_packets;
     uint32_t num_sectors;
+    bool supports_lba48;
+    uint16_t bus_master_port; // 0 if DMA isn't available
+    bool slave;
+    bool present; // Answered IDENTIFY as an ATA drive
 } ATA_Drive;
 
-extern void readStatus();
+// Physical Region Descriptor: one physically contiguous piece of the
+// buffer a DMA transfer moves data to or from. A region can't cross a
+// 64 KiB boundary, and the last one in the table has to be marked.
+typedef struct {
+    uint32_t physical_address;
+    uint16_t byte_count; // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) ATA_PRD;
+
+#define PRD_END_OF_TABLE 0x8000
+
+// Each table is one page. A DMA command moves at most as many sectors
+// as fit in the table even when none of the buffer's pages are
+// physically next to each other (and the buffer doesn't start on a
+// page boundary).
+#define ATA_PRDT_ENTRIES (PAGE_SIZE / sizeof(ATA_PRD))
+#define ATA_DMA_MAX_SECTORS ((ATA_PRDT_ENTRIES - 1) * (PAGE_SIZE / SECTOR_SIZE))
 
-bool interrupt_recieved = false;
+// Sector counts of 0 mean the largest count the command can take
+#define ATA_LBA28_MAX_SECTORS 256
+#define ATA_LBA48_MAX_SECTORS 65536
+#define ATA_LBA28_MAX_LBA     0x10000000
 
+// One table per channel. Page alignment keeps each table from
+// crossing a 64 KiB boundary, which the controller doesn't allow.
+static ATA_PRD prdts[NUM_IDE_CHANNELS][ATA_PRDT_ENTRIES] __attribute__((aligned(4096)));
 
-// Holds primary and secondary bus info for ata drives
-ATA_Drive ata_drives[2];
+extern void readStatus();
+
+// Set by ideIRQHandler, along with the status the drive had when it
+// raised the interrupt, and cleared by whoever was waiting for it
+static volatile bool ata_irq_received[NUM_IDE_CHANNELS];
+static volatile uint8_t ata_irq_status[NUM_IDE_CHANNELS];
+static volatile uint8_t ata_irq_bm_status[NUM_IDE_CHANNELS];
+
+// How many wakeups to wait for an IRQ before giving up. The PIT wakes
+// us up every millisecond, so this is roughly 5 seconds.
+#define ATA_IRQ_TIMEOUT 5000
+
+// Primary master, primary slave, secondary master, secondary slave.
+// Both drives on a channel share its ports and its IRQ.
+ATA_Drive ata_drives[ATA_MAX_DRIVES];
+
+// The drive each channel has a transfer in flight on, if any. Only one
+// drive on a channel can be busy at a time, but the two channels are
+// independent. Transfers that couldn't be left running were done
+// straight away, and their result waits here for the finish call.
+static ATA_Drive* ata_in_flight[NUM_IDE_CHANNELS];
+static bool ata_in_flight_dma[NUM_IDE_CHANNELS];
+static bool ata_in_flight_result[NUM_IDE_CHANNELS];
+
+static const char* ata_drive_names[ATA_MAX_DRIVES] = {
+    "Primary master",
+    "Primary slave",
+    "Secondary master",
+    "Secondary slave"
+};
+
+static const char* ataDriveName(ATA_Drive* drive) {
+    return ata_drive_names[drive - ata_drives];
+}
 
 static bool isFloatingBus() {
     uint8_t init_read_primary = inb(PBUS + ATA_REG_STATUS);
@@ -213,24 +277,17 @@ static bool isFloatingBus() {
     return false;
 }
 
-static void resetBus(ATA_Drive* drive) {
-    outb(drive->command_port, 1 << 2);
-    outb(drive->command_port, 1 << 1);
-    
-}
-
 static bool atapiSetup(ATA_Drive *drive){
     
     kprintf("ATAPI SETUP not implemented\n");
     return false;
     
-    char* drive_str = (drive->type == PRIMARY) 
-        ? "Primary" : "Secondary";
+    const char* drive_str = ataDriveName(drive);
     
     uint16_t bus = drive->io_port;
     
-    outb(bus + ATA_REG_DRIVESELECT, 0xA0);
-    outb(bus + ATA_REG_SECCOUNT,    0x00);
+    outb(bus + ATA_REG_DRIVESELECT, 0xA0 | (drive->slave << 4));
+    outb(bus + ATA_REG_SECCOUNT0,   0x00);
     outb(bus + ATA_REG_LBALOW,      0x00);
     outb(bus + ATA_REG_LBAMID,      0x00);
     outb(bus + ATA_REG_LBAHIGH,     0x00);
@@ -257,15 +314,12 @@ static bool atapiSetup(ATA_Drive *drive){
     }
     
     if(poll.error) {
-        kprintf("Error: Bus %s is ATAPI, gave error status\n");
+        kprintf("Error: %s is ATAPI, gave error status\n", drive_str);
         return false;
     }
     
     uint16_t identify_data[256];
-    kmemset(identify_data, 0, 256);
-    for(int i = 0; i < 256; i++) {
-        identify_data[i] = inw(bus);
-    }
+    insw(bus, identify_data, 256);
     
     uint32_t num_lba28_sectors = identify_data[60] | (identify_data[61] << 16);
     kprintf("num_lba28_sectors: %d\n", num_lba28_sectors);
@@ -278,20 +332,30 @@ static void ataSetNoInterrupts(ATA_Drive* drive) {
     outb(drive->command_port, 0x02);
 }
 
+// Every read of the alternate status register takes about 100ns and,
+// unlike the regular status register, doesn't acknowledge an
+// interrupt. Four of them give the drive the 400ns it needs to put up
+// a valid status after a drive select or a command.
+static void ataDelay400ns(ATA_Drive* drive) {
+    for(int i = 0; i < 4; i++) {
+        inb(drive->command_port);
+    }
+}
+
 // Sends ATA IDENTIFY command
 // Determines if type ATAPI, if so calls atapiSetup
 static bool ataIdentify(ATA_Drive *drive) {
-    char* drive_str = (drive->type == PRIMARY) 
-        ? "Primary" : "Secondary";
+    const char* drive_str = ataDriveName(drive);
     
     uint16_t bus = drive->io_port;
     uint16_t alt_status = drive->command_port;
     
     // Stop Interrupts, set nIEN in control register
     
-    outb(bus + ATA_REG_DRIVESELECT, 0xA0);
+    outb(bus + ATA_REG_DRIVESELECT, 0xA0 | (drive->slave << 4));
+    ataDelay400ns(drive);
     ataSetNoInterrupts(drive);
-    outb(bus + ATA_REG_SECCOUNT,    0x00);
+    outb(bus + ATA_REG_SECCOUNT0,   0x00);
     outb(bus + ATA_REG_LBALOW,      0x00);
     outb(bus + ATA_REG_LBAMID,      0x00);
     outb(bus + ATA_REG_LBAHIGH,     0x00);
@@ -301,14 +365,12 @@ static bool ataIdentify(ATA_Drive *drive) {
     
     uint8_t status = inb(bus + ATA_REG_STATUS);
     
-    // Drive doesnt exist
-    if(status == 0x00){
-        kprintf("Error: %s drive does not exist\n", drive_str);
+    // Drive doesnt exist. A channel with nothing on it floats high.
+    if(status == 0x00 || status == 0xFF){
+        kprintf("%s drive does not exist\n", drive_str);
         return false;
     }
     
-    
-    
     // Wait for BSY flag to clear
     ATA_Status_Register poll;
     inb_mem(alt_status, (uint8_t*)&poll);
@@ -321,12 +383,12 @@ static bool ataIdentify(ATA_Drive *drive) {
     uint8_t lbahigh = inb(bus + ATA_REG_LBAHIGH);
     
     if(lbamid == 0x14 && lbahigh == 0xEB){
-        kprintf("%s bus is ATAPI\n", drive_str); 
+        kprintf("%s is ATAPI\n", drive_str); 
         drive->ata_type = ATAPI;
         drive->uses_packets = true;
         return atapiSetup(drive);
     }
-    kprintf("%s bus is ATA\n", drive_str); 
+    kprintf("%s is ATA\n", drive_str); 
     
     inb_mem(alt_status, (uint8_t*)&poll);
     while(poll.data_transfer_requested != 1 && poll.error != 1){
@@ -334,27 +396,32 @@ static bool ataIdentify(ATA_Drive *drive) {
     }
     
     if(poll.error) {
-        kprintf("Error: Bus %s is ATA, but gave status of error\n");
+        kprintf("Error: %s is ATA, but gave status of error\n", drive_str);
         return false;
     }
     
     uint16_t identify_data[256];
-    kmemset(identify_data, 0, 256);
-    for(int i = 0; i < 256; i++) {
-        identify_data[i] = inw(bus);
-    }
-    
-    uint16_t supports_lba_48_word = identify_data[83];
-    if((supports_lba_48_word << 10) & 1){
-        kprintf("%s supports lba48 mode\n", drive_str);
-    }
+    insw(bus, identify_data, 256);
     
     uint32_t num_lba28_sectors = identify_data[60] | (identify_data[61] << 16);
     kprintf("num_lba28_sectors: 0x%x\n", num_lba28_sectors);
-    
     drive->num_sectors = num_lba28_sectors;
     
-    if(num_lba28_sectors == 0)
+    // Word 83 bit 10 says the drive takes the 48 bit commands, in
+    // which case words 100-103 hold the real sector count
+    uint16_t supports_lba_48_word = identify_data[83];
+    drive->supports_lba48 = (supports_lba_48_word & (1 << 10)) != 0;
+    if(drive->supports_lba48){
+        kprintf("%s supports lba48 mode\n", drive_str);
+        uint32_t num_lba48_sectors = identify_data[100] | (identify_data[101] << 16);
+        // We only keep 32 bit sector numbers around, which is 2 TiB
+        if(identify_data[102] != 0 || identify_data[103] != 0)
+            num_lba48_sectors = 0xFFFFFFFF;
+        kprintf("num_lba48_sectors: 0x%x\n", num_lba48_sectors);
+        drive->num_sectors = num_lba48_sectors;
+    }
+    
+    if(drive->num_sectors == 0)
         return false;
     
     return true;
@@ -368,44 +435,48 @@ static void idePoll(ATA_Drive* drive){
     }
 }
 
-int32_t __ataRead(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t sector_num){
-    if(drive->ata_type == ATAPI) {
-        kprintf("ATAPI Writing not implemented\n");
-        return 0;
-    }
-    
-    if(sector_num > drive->num_sectors) {
-        kprintf("ERROR: sector num too high for ATA\n");
-        kprintf("    max: 0x%x\n", drive->num_sectors);
-        return 0;
-    }
-    
-    if(sector_num + num_sectors > drive->num_sectors) {
-        kprintf("ERROR: ATA write aborted, would write off end of disk\n");
-        kprintf("    max: 0x%x\n", drive->num_sectors);
-        return 0;
-    }
-    
-    uint32_t lba = (sector_num * SECTOR_SIZE) & 0x0FFFFFFF;
-    uint8_t lba_high_ext = (uint8_t)(lba >> 24 & 0x0F);
-    // select the drive
-    uint8_t drive_select_and_high_bits = 0;
-    if(drive->type == PRIMARY){
-        drive_select_and_high_bits = ATA_PRIMARY_SELECT;
-    }else {
-        drive_select_and_high_bits = ATA_SECONDARY_SELECT;
-    }
-    
-    drive_select_and_high_bits |= lba_high_ext;
-    
+static uint32_t ataChannel(ATA_Drive* drive) {
+    return (drive->type == PRIMARY) ? ATA_PRIMARY : ATA_SECONDARY;
+}
+
+static void ataSetInterrupts(ATA_Drive* drive) {
+    outb(drive->command_port, 0x00);
+}
+
+// Sleeps until the drive raises its IRQ, which it does when a command
+// finishes or when it's ready for the next sector of a PIO transfer.
+// Interrupts are off while the flag is checked, so the IRQ can't slip
+// in between the check and the hlt. sti only takes effect after the
+// instruction following it, so "sti; hlt" can't miss it either.
+static bool ataWaitForIRQ(ATA_Drive* drive, ATA_Status_Register* status) {
+    uint32_t channel = ataChannel(drive);
+    uint32_t wakeups = 0;
+    cli();
+    while(!ata_irq_received[channel]) {
+        if(wakeups == ATA_IRQ_TIMEOUT) {
+            sti();
+            kprintf("ERROR: ATA drive never raised its IRQ\n");
+            return false;
+        }
+        __asm__ volatile ("sti\n"
+                          "hlt\n"
+                          "cli\n");
+        wakeups++;
+    }
+    // PIO transfers get one IRQ per sector, so use this one up
+    ata_irq_received[channel] = false;
+    sti();
+    
+    *(uint8_t*)status = ata_irq_status[channel];
+    return status->error == 0 && status->device_fault == 0;
+}
+
+// Selects the drive and waits for it to be ready for a new command
+static void ataSelectDrive(ATA_Drive* drive, uint8_t drive_select_and_high_bits) {
     // NOTE(alex): Technically could take up to 30s for disk to spin up :(( 
-    
-    // Select drive and set highest 4 bits of lba
     outb(drive->io_port + ATA_REG_DRIVESELECT, drive_select_and_high_bits);
-    
-    // Waste time (wait 400ns)
-    pitSleep(1);
-    resetBus(drive);
+    ataDelay400ns(drive);
+    ataSetInterrupts(drive);
     
     // Wait for BSY = 0 and data_transfer_requested == 0
     ATA_Status_Register poll = {};
@@ -413,165 +484,452 @@ int32_t __ataRead(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t s
     while(poll.busy != 0 || poll.data_transfer_requested != 0){
         inb_mem(drive->command_port, (uint8_t*)&poll);    
     }
-    
-    uint8_t lba_low = lba & 0xFF;
-    uint8_t lba_mid = (lba >> 8) & 0xFF;
-    uint8_t lba_high = (lba >> 16) & 0xFF;
+}
+
+// Selects the drive and loads the sector count and LBA, ready for a
+// read or write command. Drives that support it get the 48 bit
+// versions, which take 16 bit sector counts (0 meaning 65536), so
+// long runs of sectors need far fewer commands.
+static void ataSetupLBA(ATA_Drive* drive, uint32_t lba, uint32_t num_sectors) {
+    uint8_t drive_select_and_high_bits = drive->slave ? ATA_SLAVE_SELECT : ATA_MASTER_SELECT;
+    
+    if(drive->supports_lba48) {
+        ataSelectDrive(drive, drive_select_and_high_bits);
+        // Each register is a two byte FIFO: high bytes go in first.
+        // Our LBAs are only 32 bits, so the top 16 bits are zero.
+        outb(drive->io_port + ATA_REG_SECCOUNT0, (num_sectors >> 8) & 0xFF);
+        outb(drive->io_port + ATA_REG_LBALOW, (lba >> 24) & 0xFF);
+        outb(drive->io_port + ATA_REG_LBAMID, 0);
+        outb(drive->io_port + ATA_REG_LBAHIGH, 0);
+    } else {
+        // Select drive and set highest 4 bits of lba
+        ataSelectDrive(drive, drive_select_and_high_bits | (uint8_t)(lba >> 24 & 0x0F));
+    }
     
     // Write LBA, sector number, and sector count register
-    outb(drive->io_port + ATA_REG_SECCOUNT, num_sectors);
-    outb(drive->io_port + ATA_REG_LBALOW, lba_low);
-    outb(drive->io_port + ATA_REG_LBAMID, lba_mid);
-    outb(drive->io_port + ATA_REG_LBAHIGH, lba_high);
+    outb(drive->io_port + ATA_REG_SECCOUNT0, num_sectors & 0xFF);
+    outb(drive->io_port + ATA_REG_LBALOW, lba & 0xFF);
+    outb(drive->io_port + ATA_REG_LBAMID, (lba >> 8) & 0xFF);
+    outb(drive->io_port + ATA_REG_LBAHIGH, (lba >> 16) & 0xFF);
+    
+    // The command goes in next. An IRQ left over from one that timed
+    // out mustn't be taken as this one finishing.
+    ata_irq_received[ataChannel(drive)] = false;
+}
+
+// Picks the read or write command to match how the transfer is done
+// and how the LBA was set up
+static uint8_t ataTransferCommand(ATA_Drive* drive, bool write, bool dma) {
+    if(drive->supports_lba48) {
+        if(dma)
+            return write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        return write ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_READ_PIO_EXT;
+    }
+    if(dma)
+        return write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    return write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO;
+}
+
+// Sends a cache flush and waits for the drive to finish it
+static bool ataFlushCache(ATA_Drive* drive) {
+    ATA_Status_Register status;
+    // Same as ataSetupLBA: forget any stale IRQ before the command
+    ata_irq_received[ataChannel(drive)] = false;
+    outb(drive->io_port + ATA_REG_COMMAND,
+         drive->supports_lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+    return ataWaitForIRQ(drive, &status);
+}
+
+// Fills in a PRDT describing `byte_count` bytes at `data`, merging
+// pages that happen to be physically contiguous. Returns false if the
+// buffer needs more entries than the table has.
+static bool ataBuildPRDT(ATA_PRD* prdt, char* data, uint32_t byte_count) {
+    uint32_t entry = 0;
+    uint32_t entry_size = 0;
+    uint32_t address = (uint32_t) data;
+    while(byte_count > 0) {
+        uint32_t physical_address = virtualToPhysical(address);
+        uint32_t chunk = PAGE_SIZE - (address & (PAGE_SIZE - 1));
+        if(chunk > byte_count)
+            chunk = byte_count;
+        
+        bool contiguous = entry > 0
+            && prdt[entry - 1].physical_address + entry_size == physical_address
+            && (prdt[entry - 1].physical_address & 0xFFFF0000) == ((physical_address + chunk - 1) & 0xFFFF0000);
+        if(contiguous) {
+            entry_size += chunk;
+        } else {
+            if(entry == ATA_PRDT_ENTRIES)
+                return false;
+            prdt[entry].physical_address = physical_address;
+            prdt[entry].flags = 0;
+            entry_size = chunk;
+            entry++;
+        }
+        // A full 64 KiB region wraps around to 0, which is what the
+        // controller expects
+        prdt[entry - 1].byte_count = (uint16_t) entry_size;
+        
+        address += chunk;
+        byte_count -= chunk;
+    }
+    prdt[entry - 1].flags = PRD_END_OF_TABLE;
+    return true;
+}
+
+// Moves sectors between the disk and `data` with bus mastering, so
+// the CPU doesn't have to touch every word
+// Sets up the controller and sends the command, without waiting for
+// the transfer to finish
+static bool __ataDMAStart(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t lba, bool write){
+    uint32_t channel = ataChannel(drive);
+    ATA_PRD* prdt = prdts[channel];
+    if(!ataBuildPRDT(prdt, data, num_sectors*SECTOR_SIZE))
+        return false;
     
-    // Read sectors command
-    outb(drive->io_port + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
+    uint16_t bmide = drive->bus_master_port;
     
-    // Waste time (wait 400ns)
-    pitSleep(1);
+    // Stop whatever the controller was doing and point it at our table
+    outb(bmide + BMIDE_REG_COMMAND, 0);
+    outl(bmide + BMIDE_REG_PRDT, virtualToPhysical((uint32_t) prdt));
+    // The error and interrupt bits are cleared by writing 1s to them
+    outb(bmide + BMIDE_REG_STATUS, inb(bmide + BMIDE_REG_STATUS) | BMIDE_ERROR_BIT | BMIDE_INTERRUPT);
     
+    ataSetupLBA(drive, lba, num_sectors);
+    outb(drive->io_port + ATA_REG_COMMAND, ataTransferCommand(drive, write, true));
     
-    // Wait for ready to transfer data
-    inb_mem(drive->command_port, (uint8_t*)&poll);
-    while(poll.busy != 0 || poll.data_transfer_requested != 1){
-        inb_mem(drive->command_port, (uint8_t*)&poll);    
-    }
+    // The direction bit is set when the controller writes to memory,
+    // that is, when we're reading from the disk
+    outb(bmide + BMIDE_REG_COMMAND, (write ? 0 : BMIDE_RW) | BMIDE_START_STOP);
+    return true;
+}
+
+// The drive raises its IRQ once the whole transfer is done
+static bool __ataDMAFinish(ATA_Drive* drive){
+    uint32_t channel = ataChannel(drive);
+    ATA_Status_Register status;
+    bool succeeded = ataWaitForIRQ(drive, &status);
+    outb(drive->bus_master_port + BMIDE_REG_COMMAND, 0);
     
-    // Each sector size is 512bytes, so we will write 0 to any that we don't use at the end
-    uint32_t i;
-    uint16_t* itr = (uint16_t*)data;
-    for(i = 0; i < num_sectors*(SECTOR_SIZE/2); i++){
-        uint16_t tmp = inw(drive->io_port + ATA_REG_DATA);
-        *itr = tmp;
-        itr++;
+    if(!succeeded || (ata_irq_bm_status[channel] & BMIDE_ERROR_BIT)) {
+        kprintf("ERROR: ATA DMA transfer failed\n");
+        return false;
     }
+    return true;
+}
+
+static bool __ataDMATransfer(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t lba, bool write){
+    return __ataDMAStart(drive, data, num_sectors, lba, write) && __ataDMAFinish(drive);
+}
+
+static bool __ataPIORead(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t lba){
+    ataSetupLBA(drive, lba, num_sectors);
+    outb(drive->io_port + ATA_REG_COMMAND, ataTransferCommand(drive, false, false));
     
-    // Cache Flush
-    outb(drive->io_port + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
-    resetBus(drive);
-    
-    // Wait for ATA Interrupt
-    inb_mem(drive->command_port, (uint8_t*)&poll);
-    while(poll.busy != 0){
-        inb_mem(drive->command_port, (uint8_t*)&poll);    
+    // The drive raises its IRQ every time another sector is ready
+    ATA_Status_Register status;
+    for(uint32_t sector = 0; sector < num_sectors; sector++){
+        if(!ataWaitForIRQ(drive, &status)) {
+            kprintf("ERROR: Error reading from disk\n");
+            return false;
+        }
+        insw(drive->io_port + ATA_REG_DATA, data, SECTOR_SIZE/2);
+        data += SECTOR_SIZE;
     }
-    
-    if(poll.error == 1) {
-        kprintf("ERROR: Error writing to disk\n");
-        return 0;
+    return true;
+}
+
+static bool __ataPIOWrite(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t lba){
+    ataSetupLBA(drive, lba, num_sectors);
+    outb(drive->io_port + ATA_REG_COMMAND, ataTransferCommand(drive, true, false));
+    ataDelay400ns(drive);
+    
+    // The first sector is asked for without an IRQ
+    ATA_Status_Register status = {};
+    inb_mem(drive->command_port, (uint8_t*)&status);
+    while(status.busy != 0 || (status.data_transfer_requested != 1 && status.error != 1)){
+        inb_mem(drive->command_port, (uint8_t*)&status);    
+    }
+    
+    // After that the drive raises its IRQ once it's taken each sector,
+    // and is either ready for the next one or done
+    for(uint32_t sector = 0; sector < num_sectors; sector++){
+        if(status.error == 1) {
+            kprintf("ERROR: Error writing to disk\n");
+            return false;
+        }
+        // The data register is 16 bits wide, so no insl/outsl here.
+        // The string instructions don't care how the buffer is aligned.
+        outsw(drive->io_port + ATA_REG_DATA, data, SECTOR_SIZE/2);
+        data += SECTOR_SIZE;
+        if(!ataWaitForIRQ(drive, &status)) {
+            kprintf("ERROR: Error writing to disk\n");
+            return false;
+        }
     }
-    
-    return num_sectors*SECTOR_SIZE;
+    return true;
 }
 
-int32_t ataRead(char* data, uint32_t num_sectors, uint32_t sector_num){
-    return __ataRead(&ata_drives[0], data, num_sectors, sector_num);
+// DMA needs a driver for the controller and a word aligned buffer
+static bool ataCanDMA(ATA_Drive* drive, char* data) {
+    return drive->bus_master_port != 0 && ((uint32_t) data & 1) == 0;
 }
 
-static int32_t __ataWrite(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t sector_num){
+// The most sectors one command can move. DMA is also limited by how
+// much of a buffer fits in the PRDT.
+static uint32_t ataMaxCommandSectors(ATA_Drive* drive, bool dma) {
+    uint32_t max_sectors = drive->supports_lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+    if(dma && max_sectors > ATA_DMA_MAX_SECTORS)
+        max_sectors = ATA_DMA_MAX_SECTORS;
+    return max_sectors;
+}
+
+// Whether the drive can take a transfer of these sectors at all
+static bool ataCheckTransfer(ATA_Drive* drive, uint32_t num_sectors, uint32_t sector_num, bool write){
+    if(!drive->present) {
+        kprintf("ERROR: %s drive is not present\n", ataDriveName(drive));
+        return false;
+    }
+    
     if(drive->ata_type == ATAPI) {
         kprintf("ATAPI Writing not implemented\n");
-        return 0;
+        return false;
     }
     
     if(sector_num > drive->num_sectors) {
         kprintf("ERROR: sector num too high for ATA\n");
         kprintf("    max: 0x%x\n", drive->num_sectors);
-        return 0;
+        return false;
     }
     
     if(sector_num + num_sectors > drive->num_sectors) {
-        kprintf("ERROR: ATA write aborted, would write off end of disk\n");
+        kprintf("ERROR: ATA %s aborted, would go off end of disk\n", write ? "write" : "read");
         kprintf("    max: 0x%x\n", drive->num_sectors);
-        return 0;
+        return false;
     }
     
-    uint32_t lba = (sector_num * SECTOR_SIZE) & 0x0FFFFFFF;
-    uint8_t lba_high_ext = (uint8_t)(lba >> 24 & 0x0F);
-    // select the drive
-    uint8_t drive_select_and_high_bits = 0;
-    if(drive->type == PRIMARY){
-        drive_select_and_high_bits = ATA_PRIMARY_SELECT;
-    }else {
-        drive_select_and_high_bits = ATA_SECONDARY_SELECT;
+    if(!drive->supports_lba48 && sector_num + num_sectors > ATA_LBA28_MAX_LBA) {
+        kprintf("ERROR: sector num too high for LBA28\n");
+        return false;
     }
     
-    drive_select_and_high_bits |= lba_high_ext;
-    
-    // NOTE(alex): Technically could take up to 30s for disk to spin up :(( 
-    // Select drive and set highest 4 bits of lba
-    outb(drive->io_port + ATA_REG_DRIVESELECT, drive_select_and_high_bits);
-    
-    // Waste time (wait 400ns)
-    pitSleep(1);
-    ataSetNoInterrupts(drive);
-    
-    ATA_Status_Register poll = {};
-    inb_mem(drive->command_port, (uint8_t*)&poll);
-    while(poll.busy != 0 || poll.data_transfer_requested != 0){
-        inb_mem(drive->command_port, (uint8_t*)&poll);    
+    if(ata_in_flight[ataChannel(drive)] != NULL) {
+        kprintf("ERROR: %s channel already has a transfer in flight\n", ataDriveName(drive));
+        return false;
     }
+    return true;
+}
+
+// Splits a request into as few commands as the drive allows. Returns
+// the number of bytes transferred, or 0 on failure.
+static int32_t __ataTransfer(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t sector_num, bool write){
+    if(!ataCheckTransfer(drive, num_sectors, sector_num, write))
+        return 0;
     
-    uint8_t lba_low = lba & 0xFF;
-    uint8_t lba_mid = (lba >> 8) & 0xFF;
-    uint8_t lba_high = (lba >> 16) & 0xFF;
-    
-    // Write LBA, sector number, and sector count register
-    outb(drive->io_port + ATA_REG_SECCOUNT, num_sectors);
-    outb(drive->io_port + ATA_REG_LBALOW, lba_low);
-    outb(drive->io_port + ATA_REG_LBAMID, lba_mid);
-    outb(drive->io_port + ATA_REG_LBAHIGH, lba_high);
-    
-    // Write sectors command
-    outb(drive->io_port + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
-    
-    // Waste time (wait 400ns)
-    pitSleep(1);
-    
-    
-    // Wait for ready to transfer data
-    inb_mem(drive->command_port, (uint8_t*)&poll);
-    while(poll.busy != 0 || poll.data_transfer_requested != 1){
-        inb_mem(drive->command_port, (uint8_t*)&poll);    
+    bool dma = ataCanDMA(drive, data);
+    uint32_t max_sectors = ataMaxCommandSectors(drive, dma);
+    uint32_t remaining = num_sectors;
+    while(remaining > 0) {
+        uint32_t chunk = (remaining > max_sectors) ? max_sectors : remaining;
+        bool succeeded;
+        if(dma) {
+            succeeded = __ataDMATransfer(drive, data, chunk, sector_num, write);
+        } else if(write) {
+            succeeded = __ataPIOWrite(drive, data, chunk, sector_num);
+        } else {
+            succeeded = __ataPIORead(drive, data, chunk, sector_num);
+        }
+        if(!succeeded)
+            return 0;
+        data += chunk*SECTOR_SIZE;
+        sector_num += chunk;
+        remaining -= chunk;
+    }
+    
+    // Writes may still be sitting in the drive's cache. Whoever needs
+    // them on the platters asks for that with ataDriveFlush.
+    return num_sectors*SECTOR_SIZE;
+}
+
+int32_t __ataRead(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t sector_num){
+    return __ataTransfer(drive, data, num_sectors, sector_num, false);
+}
+
+// The first drive found, for callers that don't care which one
+static ATA_Drive* ataDefaultDrive() {
+    for(uint32_t i = 0; i < ATA_MAX_DRIVES; i++) {
+        if(ata_drives[i].present)
+            return &ata_drives[i];
     }
-    
-    // Each sector size is 512bytes, so we will write 0 to any that we don't use at the end
-    uint32_t i;
-    for(i = 0; i < num_sectors*(SECTOR_SIZE/2); i++){
-        uint16_t to_write = *data;
-        data++;
-        to_write |= (*(uint16_t*)data<<8);
-        data++;
-        outw(drive->io_port + ATA_REG_DATA, to_write);
+    return &ata_drives[0];
+}
+
+int32_t ataRead(char* data, uint32_t num_sectors, uint32_t sector_num){
+    return __ataRead(ataDefaultDrive(), data, num_sectors, sector_num);
+}
+
+static int32_t __ataWrite(ATA_Drive* drive, char* data, uint32_t num_sectors, uint32_t sector_num){
+    return __ataTransfer(drive, data, num_sectors, sector_num, true);
+}
+
+int32_t ataWrite(char* data, uint32_t num_sectors, uint32_t sector_num){
+    return __ataWrite(ataDefaultDrive(), data, num_sectors, sector_num);
+}
+
+int32_t ataDriveRead(uint8_t drive, char* data, uint32_t num_sectors, uint32_t sector_num){
+    if(drive >= ATA_MAX_DRIVES) {
+        kprintf("ERROR: No ATA drive %d\n", drive);
+        return 0;
     }
-    
-    // Cache Flush
-    outb(drive->io_port + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
-    resetBus(drive);
-    
-    // Wait for ATA Interrupt
-    inb_mem(drive->command_port, (uint8_t*)&poll);
-    while(true){
-        if(poll.data_transfer_requested == 0 && poll.busy == 0)
-            break;
-        inb_mem(drive->command_port, (uint8_t*)&poll);    
+    return __ataRead(&ata_drives[drive], data, num_sectors, sector_num);
+}
+
+int32_t ataDriveWrite(uint8_t drive, char* data, uint32_t num_sectors, uint32_t sector_num){
+    if(drive >= ATA_MAX_DRIVES) {
+        kprintf("ERROR: No ATA drive %d\n", drive);
+        return 0;
     }
-    
-    if(poll.error == 1) {
-        kprintf("ERROR: Error writing to disk\n");
+    return __ataWrite(&ata_drives[drive], data, num_sectors, sector_num);
+}
+
+// Makes every write the drive has acknowledged so far durable
+bool ataDriveFlush(uint8_t drive){
+    if(drive >= ATA_MAX_DRIVES) {
+        kprintf("ERROR: No ATA drive %d\n", drive);
+        return false;
+    }
+    ATA_Drive* ata_drive = &ata_drives[drive];
+    if(!ata_drive->present || ata_drive->ata_type == ATAPI)
+        return true;
+    ataSelectDrive(ata_drive, ata_drive->slave ? ATA_SLAVE_SELECT : ATA_MASTER_SELECT);
+    if(!ataFlushCache(ata_drive)) {
+        kprintf("ERROR: Error flushing disk cache\n");
+        return false;
+    }
+    return true;
+}
+
+bool ataDrivePresent(uint8_t drive){
+    return drive < ATA_MAX_DRIVES && ata_drives[drive].present;
+}
+
+uint32_t ataDriveSectors(uint8_t drive){
+    if(!ataDrivePresent(drive))
         return 0;
+    return ata_drives[drive].num_sectors;
+}
+
+uint8_t ataDriveChannel(uint8_t drive){
+    return drive / 2;
+}
+
+// Starts a transfer and returns straight away, leaving the channel
+// busy until ataDriveFinishTransfer. Only transfers that fit in one DMA
+// command can be left running like this; anything else is done before
+// this returns.
+void ataDriveStartTransfer(uint8_t drive, char* data, uint32_t num_sectors, uint32_t sector_num, bool write){
+    if(drive >= ATA_MAX_DRIVES) {
+        kprintf("ERROR: No ATA drive %d\n", drive);
+        // No channel to leave it on, so the finish fails on the same check
+        return;
+    }
+    ATA_Drive* ata_drive = &ata_drives[drive];
+    uint32_t channel = ataChannel(ata_drive);
+    
+    bool dma = ataCanDMA(ata_drive, data) && num_sectors <= ataMaxCommandSectors(ata_drive, true);
+    bool succeeded;
+    if(dma) {
+        succeeded = ataCheckTransfer(ata_drive, num_sectors, sector_num, write)
+            && __ataDMAStart(ata_drive, data, num_sectors, sector_num, write);
+        // Nothing to wait for if it never started
+        dma = succeeded;
+    } else {
+        succeeded = __ataTransfer(ata_drive, data, num_sectors, sector_num, write) != 0;
+    }
+    ata_in_flight[channel] = ata_drive;
+    ata_in_flight_dma[channel] = dma;
+    ata_in_flight_result[channel] = succeeded;
+}
+
+bool ataDriveFinishTransfer(uint8_t drive){
+    if(drive >= ATA_MAX_DRIVES) {
+        kprintf("ERROR: No ATA drive %d\n", drive);
+        return false;
+    }
+    ATA_Drive* ata_drive = &ata_drives[drive];
+    uint32_t channel = ataChannel(ata_drive);
+    if(ata_in_flight[channel] != ata_drive) {
+        kprintf("ERROR: No transfer in flight on %s drive\n", ataDriveName(ata_drive));
+        return false;
     }
+    ata_in_flight[channel] = NULL;
+    if(ata_in_flight_dma[channel])
+        return __ataDMAFinish(ata_drive);
+    return ata_in_flight_result[channel];
+}
+
+#define ATA_BENCHMARK_SECTORS 2048
+#define ATA_BENCHMARK_CHUNK   128
+
+// Reads ATA_BENCHMARK_SECTORS from the start of the drive, ATA_BENCHMARK_CHUNK
+// at a time, either with PIO or with DMA. Returns sectors/sec.
+static uint32_t benchmarkTransfer(ATA_Drive* drive, char* buffer, bool dma) {
+    PITResult counter = pitAddCounter();
+    if(counter.isError) {
+        kprintf("ataBenchmark couldn't get a PIT counter!\n");
+        return 0;
+    }
+    uint8_t counter_id = counter.counter_id;
     
-    return num_sectors*SECTOR_SIZE;
+    for(uint32_t sector = 0; sector < ATA_BENCHMARK_SECTORS; sector += ATA_BENCHMARK_CHUNK) {
+        bool succeeded = dma
+            ? __ataDMATransfer(drive, buffer, ATA_BENCHMARK_CHUNK, sector, false)
+            : __ataPIORead(drive, buffer, ATA_BENCHMARK_CHUNK, sector);
+        if(!succeeded) {
+            pitDeactivateCounter(counter_id);
+            return 0;
+        }
+    }
+    
+    uint32_t elapsed_millis = pitGetCounterCount(counter_id).count;
+    pitDeactivateCounter(counter_id);
+    if(elapsed_millis == 0) {
+        elapsed_millis = 1;
+    }
+    return (ATA_BENCHMARK_SECTORS * 1000) / elapsed_millis;
 }
 
-int32_t ataWrite(char* data, uint32_t num_sectors, uint32_t sector_num){
-    return __ataWrite(&ata_drives[0], data, num_sectors, sector_num);
+// Compares PIO and DMA read throughput on a drive
+void ataBenchmark(uint8_t drive){
+    if(!ataDrivePresent(drive) || ata_drives[drive].num_sectors < ATA_BENCHMARK_SECTORS) {
+        kprintf("ataBenchmark needs a drive with at least %u sectors\n", ATA_BENCHMARK_SECTORS);
+        return;
+    }
+    ATA_Drive* ata_drive = &ata_drives[drive];
+    char* buffer = kheapAlloc(ATA_BENCHMARK_CHUNK * SECTOR_SIZE);
+    kprintf("==== ATA BENCHMARK (%s) ====\n", ataDriveName(ata_drive));
+    kprintf("PIO: %u sectors/sec\n", benchmarkTransfer(ata_drive, buffer, false));
+    if(ataCanDMA(ata_drive, buffer)) {
+        kprintf("DMA: %u sectors/sec\n", benchmarkTransfer(ata_drive, buffer, true));
+    }
+    kprintf("============================\n");
+    kheapFree(buffer);
 }
 
-void ideIRQHandler() {
-    interrupt_recieved = true;
-    kprintf("written!!!!!!!!!!!!!!!!!!!!!\n");
+// Called from the IRQ14 and IRQ15 ISRs with the channel that raised it.
+// Both drives on the channel share the ports, so the master's do.
+void ideIRQHandler(uint32_t channel) {
+    ATA_Drive* drive = &ata_drives[channel * 2];
+    // Reading the regular status register acknowledges the interrupt
+    ata_irq_status[channel] = inb(drive->io_port + ATA_REG_STATUS);
+    if(drive->bus_master_port != 0) {
+        uint8_t bm_status = inb(drive->bus_master_port + BMIDE_REG_STATUS);
+        ata_irq_bm_status[channel] = bm_status;
+        // Clear the interrupt bit, leaving the error bit for the waiter
+        outb(drive->bus_master_port + BMIDE_REG_STATUS, (bm_status & ~(BMIDE_ERROR_BIT)) | BMIDE_INTERRUPT);
+    }
+    ata_irq_received[channel] = true;
+    sendEndOfInterrupt();
 }
 
 bool ideInit() {
@@ -580,33 +938,57 @@ bool ideInit() {
         return false;   
     }
     
-    ATA_Drive primary_drive;
-    primary_drive.ata_type = ATA;
-    primary_drive.type = PRIMARY;
-    primary_drive.io_port = PBUS;
-    primary_drive.command_port = PBUSC;
-    
-    
-    ATA_Drive secondary_drive;
-    secondary_drive.ata_type =  ATA;
-    secondary_drive.type = SECONDARY;
-    secondary_drive.io_port = SBUS;
-    secondary_drive.command_port = PBUSC;
-    
-    ata_drives[0] = primary_drive;
-    ata_drives[1] = secondary_drive;
-    
-    // IDENTIFY
-    if(ataIdentify(&primary_drive)) {
-        kprintf("Primary Bus is setup and read to read/write\n");
-    }
-    if(ataIdentify(&secondary_drive)) {
-        kprintf("Secondary Bus is setup and ready to read/write\n");
-    }else{
-        kprintf("Secondary Bus is NOT setup\n");
+    static const uint16_t io_ports[NUM_IDE_CHANNELS] = { PBUS, SBUS };
+    static const uint16_t command_ports[NUM_IDE_CHANNELS] = { PBUSC, SBUSC };
+    
+    // BAR4 of the IDE controller holds the bus master registers for
+    // both channels, primary first
+    uint16_t bus_master_base = 0;
+    PCIDevice ide_controller;
+    if(pciFindDevice(0x01, 0x01, &ide_controller) && (ide_controller.prog_if & 0x80)) {
+        uint32_t bar4 = pciReadBar(ide_controller.bus, ide_controller.device, ide_controller.function, 4);
+        if(bar4 & 1) {
+            pciEnableBusMastering(ide_controller);
+            bus_master_base = bar4 & 0xFFFC;
+            kprintf("IDE bus mastering at 0x%x\n", bus_master_base);
+        }
+    }
+    
+    for(uint32_t i = 0; i < ATA_MAX_DRIVES; i++) {
+        uint32_t channel = i / 2;
+        ATA_Drive drive;
+        kmemset(&drive, 0, sizeof(drive));
+        drive.ata_type = ATA;
+        drive.type = (channel == ATA_PRIMARY) ? PRIMARY : SECONDARY;
+        drive.slave = (i % 2) == 1;
+        drive.io_port = io_ports[channel];
+        drive.command_port = command_ports[channel];
+        drive.supports_lba48 = false;
+        drive.bus_master_port = (bus_master_base != 0) ? bus_master_base + (channel * 8) : 0;
+        ata_drives[i] = drive;
     }
     
-    return true;
+    // IDENTIFY
+    bool any_present = false;
+    for(uint32_t i = 0; i < ATA_MAX_DRIVES; i++) {
+        ATA_Drive* drive = &ata_drives[i];
+        drive->present = ataIdentify(drive) && drive->ata_type == ATA;
+        if(drive->present) {
+            kprintf("%s is setup and ready to read/write (drive %d)\n", ataDriveName(drive), i);
+            any_present = true;
+        }
+    }
+    
+    // Transfers wait on IRQ14/15, which come in through the cascade
+    for(uint32_t channel = 0; channel < NUM_IDE_CHANNELS; channel++) {
+        ata_irq_received[channel] = false;
+        ata_in_flight[channel] = NULL;
+    }
+    irqClearMask(2);
+    irqClearMask(14);
+    irqClearMask(15);
+    
+    return any_present;
 }
     
     
\ No newline at end of file
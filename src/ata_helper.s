@@ -87,12 +87,27 @@ ataWriteToPort:
 
 
 
-#.extern ideIRQHandler
+# IRQ14 (primary channel) and IRQ15 (secondary channel)
+# ideIRQHandler takes the channel and sends the EOI
+.extern ideIRQHandler
 .global ideIRQISR
 .type ideIRQISR, @function
 ideIRQISR:
 	pushal
 	cld
-#call ideIRQHandler
+	push $0
+	call ideIRQHandler
+	add $4, %esp
+	popal
+	iret
+
+.global ideSecondaryIRQISR
+.type ideSecondaryIRQISR, @function
+ideSecondaryIRQISR:
+	pushal
+	cld
+	push $1
+	call ideIRQHandler
+	add $4, %esp
 	popal
 	iret
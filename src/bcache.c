@@ -0,0 +1,503 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <bcache.h>
+#include <block.h>
+#include <ide.h>
+#include <kheap.h>
+#include <kstdio.h>
+#include <kstdlib.h>
+
+#define BCACHE_HASH_SIZE 128
+
+// Reads are handled this many sectors at a time. Each run of
+// consecutive misses in a batch goes to the block queue as one
+// multi-sector request, so it reaches the drive as one command however
+// long it is. A batch and a full read-ahead window together can't
+// evict each other before the reads land.
+#define BCACHE_MAX_BATCH 64
+#define BCACHE_MAX_SPAN  (BCACHE_MAX_BATCH + BCACHE_MAX_READAHEAD)
+
+// The read-ahead window starts here and doubles every time a
+// sequential reader misses, up to the tunable limit
+#define BCACHE_READAHEAD_MIN 8
+
+typedef struct CacheBuffer {
+    uint8_t drive;
+    bool valid;
+    bool dirty;
+    // Written back, but not known to have reached the drive yet. It
+    // stays dirty until an unplug shows it did.
+    bool writing;
+    // Read in ahead of time and not asked for yet
+    bool prefetched;
+    uint32_t sector;
+    // Chain of buffers in the same hash bucket
+    struct CacheBuffer* hash_next;
+    // Position in the LRU list, most recently used first
+    struct CacheBuffer* lru_prev;
+    struct CacheBuffer* lru_next;
+    uint8_t data[BCACHE_BLOCK_SIZE];
+} CacheBuffer;
+
+static CacheBuffer buffers[BCACHE_BUFFER_COUNT];
+static CacheBuffer* hash_table[BCACHE_HASH_SIZE];
+static CacheBuffer* lru_head;
+static CacheBuffer* lru_tail;
+
+// Per drive sequential read detection
+typedef struct {
+    // Where the next read starts if the reader is sequential
+    uint32_t next_sector;
+    // Sectors to prefetch on the next sequential miss, 0 if the last
+    // read wasn't sequential
+    uint32_t window;
+} ReadAhead;
+
+static ReadAhead read_ahead[ATA_MAX_DRIVES];
+static uint32_t read_ahead_max = 32;
+
+static struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;
+    uint32_t prefetched;        // Sectors read ahead
+    uint32_t prefetch_hits;     // ... that were asked for later
+    uint32_t prefetch_wasted;   // ... that were evicted without being
+} stats;
+
+static uint32_t hashKey(uint8_t drive, uint32_t sector) {
+    return (sector + (drive * 31)) % BCACHE_HASH_SIZE;
+}
+
+static void lruRemove(CacheBuffer* buffer) {
+    if (buffer->lru_prev != NULL) {
+        buffer->lru_prev->lru_next = buffer->lru_next;
+    } else {
+        lru_head = buffer->lru_next;
+    }
+    if (buffer->lru_next != NULL) {
+        buffer->lru_next->lru_prev = buffer->lru_prev;
+    } else {
+        lru_tail = buffer->lru_prev;
+    }
+}
+
+static void lruPushFront(CacheBuffer* buffer) {
+    buffer->lru_prev = NULL;
+    buffer->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = buffer;
+    } else {
+        lru_tail = buffer;
+    }
+    lru_head = buffer;
+}
+
+static void hashRemove(CacheBuffer* buffer) {
+    CacheBuffer** iter = &hash_table[hashKey(buffer->drive, buffer->sector)];
+    while (*iter != buffer) {
+        iter = &(*iter)->hash_next;
+    }
+    *iter = buffer->hash_next;
+}
+
+void bcacheInit() {
+    kmemset(hash_table, 0, sizeof(hash_table));
+    kmemset(&stats, 0, sizeof(stats));
+    kmemset(read_ahead, 0, sizeof(read_ahead));
+    lru_head = NULL;
+    lru_tail = NULL;
+    for (uint32_t i = 0; i < BCACHE_BUFFER_COUNT; i++) {
+        buffers[i].valid = false;
+        buffers[i].dirty = false;
+        buffers[i].writing = false;
+        buffers[i].prefetched = false;
+        buffers[i].hash_next = NULL;
+        lruPushFront(&buffers[i]);
+    }
+}
+
+static CacheBuffer* lookup(uint8_t drive, uint32_t sector) {
+    CacheBuffer* iter = hash_table[hashKey(drive, sector)];
+    while (iter != NULL) {
+        if (iter->drive == drive && iter->sector == sector) {
+            return iter;
+        }
+        iter = iter->hash_next;
+    }
+    return NULL;
+}
+
+// Queues a write of a dirty buffer. The block queue keeps its own copy
+// of the data, and keeps retrying it if the drive fails it, so once
+// it's queued the buffer can be reused. Returns false if it couldn't be
+// queued, in which case the buffer's copy is the only one.
+static bool writeBack(CacheBuffer* buffer) {
+    if (!blockSubmitWrite(buffer->drive, (const char*) buffer->data, buffer->sector, 1)) {
+        return false;
+    }
+    buffer->writing = true;
+    stats.writebacks++;
+    return true;
+}
+
+// Called with the result of unplugging the drive. If it worked, every
+// write-back queued for it so far has reached it. If not, there's no
+// telling which ones did, so they'll all be written back again.
+static void settleWriteBacks(uint8_t drive, bool succeeded) {
+    for (uint32_t i = 0; i < BCACHE_BUFFER_COUNT; i++) {
+        CacheBuffer* buffer = &buffers[i];
+        if (buffer->valid && buffer->writing && buffer->drive == drive) {
+            buffer->writing = false;
+            if (succeeded) {
+                buffer->dirty = false;
+            }
+        }
+    }
+}
+
+// Takes the least recently used buffer that can go (writing it back if
+// it's dirty) and gives it to the sector. Its contents are left for the
+// caller. Returns NULL if every buffer is dirty and can't be written
+// back.
+static CacheBuffer* claimBuffer(uint8_t drive, uint32_t sector) {
+    CacheBuffer* buffer = lru_tail;
+    while (buffer != NULL && buffer->valid && buffer->dirty && !buffer->writing && !writeBack(buffer)) {
+        buffer = buffer->lru_prev;
+    }
+    if (buffer == NULL) {
+        return NULL;
+    }
+    if (buffer->valid) {
+        hashRemove(buffer);
+        stats.evictions++;
+        if (buffer->prefetched) {
+            stats.prefetch_wasted++;
+        }
+    }
+    buffer->drive = drive;
+    buffer->sector = sector;
+    buffer->valid = true;
+    buffer->dirty = false;
+    buffer->writing = false;
+    buffer->prefetched = false;
+    uint32_t key = hashKey(drive, sector);
+    buffer->hash_next = hash_table[key];
+    hash_table[key] = buffer;
+    return buffer;
+}
+
+static void touch(CacheBuffer* buffer) {
+    lruRemove(buffer);
+    lruPushFront(buffer);
+}
+
+static void invalidate(CacheBuffer* buffer) {
+    hashRemove(buffer);
+    buffer->valid = false;
+    buffer->dirty = false;
+    buffer->writing = false;
+    buffer->prefetched = false;
+    // Make it the first to be reused
+    lruRemove(buffer);
+    buffer->lru_next = NULL;
+    buffer->lru_prev = lru_tail;
+    if (lru_tail != NULL) {
+        lru_tail->lru_next = buffer;
+    } else {
+        lru_head = buffer;
+    }
+    lru_tail = buffer;
+}
+
+// A hit on a sector that was read ahead is what read-ahead is for
+static void countHit(CacheBuffer* buffer) {
+    stats.hits++;
+    if (buffer->prefetched) {
+        stats.prefetch_hits++;
+        buffer->prefetched = false;
+    }
+}
+
+// A run of consecutive sectors that have to come from the drive. It's
+// read as one request into a bounce buffer, since the cache buffers it
+// ends up in aren't next to each other in memory.
+typedef struct {
+    uint32_t first; // Index into the batch
+    uint32_t count;
+    char* data;
+    bool read;
+} MissRun;
+
+// Reads up to BCACHE_MAX_BATCH sectors. If any of them have to come
+// from the drive, up to `read_ahead_sectors` uncached sectors after
+// them are read as well. When the batch ends in a miss they extend its
+// last run, so they go out in the same command instead of costing a
+// round trip of their own later.
+static bool readBatch(uint8_t drive, uint32_t sector, uint32_t num_sectors, uint8_t* data,
+                      uint32_t read_ahead_sectors, bool* went_to_drive) {
+    CacheBuffer* batch[BCACHE_MAX_SPAN];
+    bool missed[BCACHE_MAX_SPAN];
+    uint32_t span = 0;
+    bool any_missed = false;
+    bool succeeded = true;
+    
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        CacheBuffer* buffer = lookup(drive, sector + i);
+        missed[i] = (buffer == NULL);
+        if (buffer == NULL) {
+            buffer = claimBuffer(drive, sector + i);
+            if (buffer == NULL) {
+                succeeded = false;
+                break;
+            }
+            stats.misses++;
+            any_missed = true;
+        } else {
+            countHit(buffer);
+        }
+        touch(buffer);
+        batch[span++] = buffer;
+    }
+    
+    if (any_missed && succeeded) {
+        for (uint32_t i = 0; i < read_ahead_sectors; i++) {
+            uint32_t ahead = sector + num_sectors + i;
+            CacheBuffer* buffer = lookup(drive, ahead);
+            missed[span] = (buffer == NULL);
+            if (buffer == NULL) {
+                buffer = claimBuffer(drive, ahead);
+                if (buffer == NULL) {
+                    break;
+                }
+                buffer->prefetched = true;
+                touch(buffer);
+                stats.prefetched++;
+            }
+            batch[span++] = buffer;
+        }
+    }
+    
+    MissRun runs[(BCACHE_MAX_SPAN / 2) + 1];
+    uint32_t run_count = 0;
+    for (uint32_t i = 0; i < span;) {
+        if (!missed[i]) {
+            i++;
+            continue;
+        }
+        uint32_t end = i;
+        while (end < span && missed[end]) {
+            end++;
+        }
+        MissRun* run = &runs[run_count++];
+        run->first = i;
+        run->count = end - i;
+        run->data = kheapAlloc(run->count * BCACHE_BLOCK_SIZE);
+        run->read = false;
+        // If it can't be queued, `read` stays false
+        blockSubmitRead(drive, run->data, sector + i, run->count, &run->read);
+        i = end;
+    }
+    
+    if (run_count > 0) {
+        // Only the reads' own results matter here. A write-back that
+        // failed on the way is still queued, and bcacheSync reports it.
+        settleWriteBacks(drive, blockUnplug(drive));
+    }
+    
+    for (uint32_t i = 0; i < run_count; i++) {
+        MissRun* run = &runs[i];
+        for (uint32_t j = 0; j < run->count; j++) {
+            CacheBuffer* buffer = batch[run->first + j];
+            if (run->read) {
+                kmemcpy(buffer->data, run->data + (j * BCACHE_BLOCK_SIZE), BCACHE_BLOCK_SIZE);
+            } else {
+                // Don't leave garbage behind for the next reader
+                invalidate(buffer);
+            }
+        }
+        if (!run->read && run->first < num_sectors) {
+            succeeded = false;
+        }
+        kheapFree(run->data);
+    }
+    if (!succeeded) {
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        kmemcpy(data + (i * BCACHE_BLOCK_SIZE), batch[i]->data, BCACHE_BLOCK_SIZE);
+    }
+    if (any_missed) {
+        *went_to_drive = true;
+    }
+    return true;
+}
+
+// How far to read ahead of a read of these sectors. Sequential readers
+// get a window, anyone else gets nothing. Read-ahead stops at the end
+// of the drive, since a command that runs off the end would fail the
+// read along with it.
+static uint32_t readAheadWindow(uint8_t drive, uint32_t sector, uint32_t num_sectors) {
+    ReadAhead* state = &read_ahead[drive];
+    bool sequential = (sector == state->next_sector);
+    state->next_sector = sector + num_sectors;
+    if (!sequential || read_ahead_max == 0) {
+        state->window = 0;
+        return 0;
+    }
+    if (state->window == 0) {
+        state->window = BCACHE_READAHEAD_MIN;
+    }
+    if (state->window > read_ahead_max) {
+        state->window = read_ahead_max;
+    }
+    
+    uint32_t window = state->window;
+    uint32_t drive_sectors = ataDriveSectors(drive);
+    uint32_t end = sector + num_sectors;
+    if (end >= drive_sectors) {
+        return 0;
+    }
+    if (window > drive_sectors - end) {
+        window = drive_sectors - end;
+    }
+    return window;
+}
+
+bool bcacheRead(uint8_t drive, uint32_t sector, uint32_t num_sectors, void* data) {
+    if (drive >= ATA_MAX_DRIVES) {
+        return false;
+    }
+    uint32_t window = readAheadWindow(drive, sector, num_sectors);
+    
+    uint8_t* iter = (uint8_t*) data;
+    bool went_to_drive = false;
+    while (num_sectors > 0) {
+        uint32_t batch = (num_sectors > BCACHE_MAX_BATCH) ? BCACHE_MAX_BATCH : num_sectors;
+        // Only the last batch reads ahead, the others are covered by
+        // the batches after them
+        uint32_t read_ahead_sectors = (batch == num_sectors) ? window : 0;
+        if (!readBatch(drive, sector, batch, iter, read_ahead_sectors, &went_to_drive)) {
+            return false;
+        }
+        iter += batch * BCACHE_BLOCK_SIZE;
+        sector += batch;
+        num_sectors -= batch;
+    }
+    
+    // A sequential reader that still had to wait on the drive has
+    // outrun the window, so the next one is bigger
+    ReadAhead* state = &read_ahead[drive];
+    if (went_to_drive && state->window != 0 && state->window < read_ahead_max) {
+        state->window *= 2;
+        if (state->window > read_ahead_max) {
+            state->window = read_ahead_max;
+        }
+    }
+    return true;
+}
+
+bool bcacheWrite(uint8_t drive, uint32_t sector, uint32_t num_sectors, const void* data) {
+    const uint8_t* iter = (const uint8_t*) data;
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        CacheBuffer* buffer = lookup(drive, sector + i);
+        if (buffer == NULL) {
+            // The whole sector is being replaced, so no need to read it
+            buffer = claimBuffer(drive, sector + i);
+            if (buffer == NULL) {
+                return false;
+            }
+        }
+        kmemcpy(buffer->data, iter, BCACHE_BLOCK_SIZE);
+        buffer->dirty = true;
+        // Any write-back already queued has the old contents
+        buffer->writing = false;
+        buffer->prefetched = false;
+        touch(buffer);
+        iter += BCACHE_BLOCK_SIZE;
+    }
+    return true;
+}
+
+void bcacheInvalidate(uint8_t drive, uint32_t sector, uint32_t num_sectors) {
+    for (uint32_t i = 0; i < BCACHE_BUFFER_COUNT; i++) {
+        CacheBuffer* buffer = &buffers[i];
+        if (buffer->valid && buffer->drive == drive
+            && buffer->sector >= sector && buffer->sector - sector < num_sectors) {
+            invalidate(buffer);
+        }
+    }
+}
+
+bool bcacheEvict(uint8_t drive, uint32_t sector, uint32_t num_sectors) {
+    bool succeeded = true;
+    for (uint32_t i = 0; i < BCACHE_BUFFER_COUNT; i++) {
+        CacheBuffer* buffer = &buffers[i];
+        if (!buffer->valid || buffer->drive != drive
+            || buffer->sector < sector || buffer->sector - sector >= num_sectors) {
+            continue;
+        }
+        // A write-back already queued has the block layer's copy, and
+        // the block layer keeps it ahead of any read of the sector
+        if (buffer->dirty && !buffer->writing && !writeBack(buffer)) {
+            // Still the only copy, so it stays
+            succeeded = false;
+            continue;
+        }
+        invalidate(buffer);
+    }
+    return succeeded;
+}
+
+void bcacheSetReadAhead(uint32_t max_sectors) {
+    if (max_sectors > BCACHE_MAX_READAHEAD) {
+        max_sectors = BCACHE_MAX_READAHEAD;
+    }
+    read_ahead_max = max_sectors;
+}
+
+uint32_t bcacheGetReadAhead() {
+    return read_ahead_max;
+}
+
+bool bcacheSync() {
+    // Everything goes through the block queue, which sorts and merges
+    // the writes before they reach the drive. The flush at the end is
+    // the only one, however many sectors were written.
+    bool succeeded = true;
+    for (uint32_t i = 0; i < BCACHE_BUFFER_COUNT; i++) {
+        if (buffers[i].valid && buffers[i].dirty && !buffers[i].writing && !writeBack(&buffers[i])) {
+            succeeded = false;
+        }
+    }
+    bool flushed = blockFlushAll();
+    for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        settleWriteBacks(drive, flushed);
+    }
+    return succeeded && flushed;
+}
+
+void bcacheDump() {
+    uint32_t valid = 0;
+    uint32_t dirty = 0;
+    for (uint32_t i = 0; i < BCACHE_BUFFER_COUNT; i++) {
+        if (buffers[i].valid) {
+            valid++;
+            if (buffers[i].dirty) {
+                dirty++;
+            }
+        }
+    }
+    uint32_t lookups = stats.hits + stats.misses;
+    uint32_t hit_rate = (lookups == 0) ? 0 : (stats.hits * 100) / lookups;
+    kprintf("Buffer cache: %u of %u sectors in use, %u dirty\n", valid, BCACHE_BUFFER_COUNT, dirty);
+    kprintf("  %u hits, %u misses (%u percent hits)\n", stats.hits, stats.misses, hit_rate);
+    kprintf("  %u evictions, %u writebacks\n", stats.evictions, stats.writebacks);
+    uint32_t prefetch_rate = (stats.prefetched == 0) ? 0 : (stats.prefetch_hits * 100) / stats.prefetched;
+    kprintf("  Read-ahead: up to %u sectors, %u read ahead, %u used (%u percent), %u wasted\n",
+            read_ahead_max, stats.prefetched, stats.prefetch_hits, prefetch_rate, stats.prefetch_wasted);
+}
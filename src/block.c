@@ -0,0 +1,438 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <block.h>
+#include <ide.h>
+#include <kheap.h>
+#include <kstdio.h>
+#include <kstdlib.h>
+
+// Merged runs are read or written through one bounce buffer, so keep
+// them to a sensible size
+#define BLOCK_MAX_MERGED_SECTORS 1024
+
+// A write the drive keeps turning down (a bad sector, or a drive that's
+// gone) is given up on after this many tries, so it can't wedge the
+// queue for good
+#define BLOCK_MAX_WRITE_ATTEMPTS 3
+
+typedef struct {
+    bool write;
+    uint32_t sector;
+    uint32_t num_sectors;
+    // The caller's buffer for reads, our own copy of the data for writes
+    char* buffer;
+    // Reads: where to say whether it worked, if the caller cares
+    bool* succeeded;
+    // Writes: the drive turned it down at the last unplug, so it stays
+    // queued for the next one, unless it's run out of attempts
+    bool failed;
+    uint32_t attempts;
+} BlockRequest;
+
+typedef struct {
+    // Kept sorted by sector
+    BlockRequest requests[BLOCK_QUEUE_DEPTH];
+    uint32_t count;
+    // Where the last dispatch left off, which is where the elevator
+    // carries on from
+    uint32_t head;
+    // Whether writes have gone to the drive since it was last flushed
+    bool needs_flush;
+    BlockQueueStats stats;
+} BlockQueue;
+
+static BlockQueue queues[ATA_MAX_DRIVES];
+
+void blockInit() {
+    for (uint32_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        kmemset(&queues[drive], 0, sizeof(BlockQueue));
+    }
+}
+
+static BlockQueue* getQueue(uint8_t drive) {
+    if (drive >= ATA_MAX_DRIVES) {
+        kprintf("Block request for a drive that doesn't exist (%u)!\n", drive);
+        while (true);
+    }
+    return &queues[drive];
+}
+
+static bool rangesOverlap(uint32_t a_start, uint32_t a_count, uint32_t b_start, uint32_t b_count) {
+    return a_start < b_start + b_count && b_start < a_start + a_count;
+}
+
+// Whether any queued request touches the same sectors. If so, the new
+// request can't be reordered around it.
+static bool overlapsPending(BlockQueue* queue, uint32_t sector, uint32_t num_sectors, bool writes_only) {
+    for (uint32_t i = 0; i < queue->count; i++) {
+        BlockRequest* request = &queue->requests[i];
+        if (writes_only && !request->write) {
+            continue;
+        }
+        if (rangesOverlap(request->sector, request->num_sectors, sector, num_sectors)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void insertRequest(BlockQueue* queue, BlockRequest request) {
+    uint32_t index = queue->count;
+    while (index > 0 && queue->requests[index - 1].sector > request.sector) {
+        queue->requests[index] = queue->requests[index - 1];
+        index--;
+    }
+    queue->requests[index] = request;
+    queue->count++;
+}
+
+// Tries to fold a write into a queued write that it directly follows
+// or precedes. Both buffers are ours, so they can just be joined.
+static bool mergeWrite(BlockQueue* queue, const char* buffer, uint32_t sector, uint32_t num_sectors) {
+    for (uint32_t i = 0; i < queue->count; i++) {
+        BlockRequest* request = &queue->requests[i];
+        if (!request->write || request->num_sectors + num_sectors > BLOCK_MAX_MERGED_SECTORS) {
+            continue;
+        }
+        if (request->sector + request->num_sectors == sector) {
+            // Back merge
+            request->buffer = kheapRealloc(request->buffer, (request->num_sectors + num_sectors) * IDE_SECTOR_SIZE);
+            kmemcpy(request->buffer + request->num_sectors * IDE_SECTOR_SIZE, buffer, num_sectors * IDE_SECTOR_SIZE);
+            request->num_sectors += num_sectors;
+            return true;
+        }
+        if (sector + num_sectors == request->sector) {
+            // Front merge. This doesn't change the order of the queue,
+            // since nothing else can sit in the sectors in between.
+            char* joined = kheapAlloc((request->num_sectors + num_sectors) * IDE_SECTOR_SIZE);
+            kmemcpy(joined, buffer, num_sectors * IDE_SECTOR_SIZE);
+            kmemcpy(joined + num_sectors * IDE_SECTOR_SIZE, request->buffer, request->num_sectors * IDE_SECTOR_SIZE);
+            kheapFree(request->buffer);
+            request->buffer = joined;
+            request->sector = sector;
+            request->num_sectors += num_sectors;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool blockSubmitRead(uint8_t drive, char* buffer, uint32_t sector, uint32_t num_sectors, bool* succeeded) {
+    BlockQueue* queue = getQueue(drive);
+    // A read has to see any write queued before it. If those writes
+    // didn't make it, neither can the read.
+    if (queue->count == BLOCK_QUEUE_DEPTH || overlapsPending(queue, sector, num_sectors, true)) {
+        if (!blockUnplug(drive)) {
+            return false;
+        }
+    }
+    queue->stats.submitted++;
+    insertRequest(queue, (BlockRequest) { false, sector, num_sectors, buffer, succeeded, false, 0 });
+    return true;
+}
+
+bool blockSubmitWrite(uint8_t drive, const char* buffer, uint32_t sector, uint32_t num_sectors) {
+    BlockQueue* queue = getQueue(drive);
+    // Writes to the same sectors as a queued request have to wait for
+    // it, otherwise the elevator might swap them around
+    if (overlapsPending(queue, sector, num_sectors, false)) {
+        if (!blockUnplug(drive)) {
+            return false;
+        }
+    }
+    queue->stats.submitted++;
+    if (mergeWrite(queue, buffer, sector, num_sectors)) {
+        queue->stats.merged++;
+        return true;
+    }
+    if (queue->count == BLOCK_QUEUE_DEPTH) {
+        if (!blockUnplug(drive)) {
+            return false;
+        }
+    }
+    char* copy = kheapAlloc(num_sectors * IDE_SECTOR_SIZE);
+    kmemcpy(copy, buffer, num_sectors * IDE_SECTOR_SIZE);
+    insertRequest(queue, (BlockRequest) { true, sector, num_sectors, copy, NULL, false, 0 });
+    return true;
+}
+
+// Finds how many requests starting at `first` can go to the drive as
+// one command: same direction, with each one starting right where the
+// last one ended.
+static uint32_t mergeableRun(BlockQueue* queue, uint32_t first, uint32_t end) {
+    BlockRequest* request = &queue->requests[first];
+    uint32_t total_sectors = request->num_sectors;
+    uint32_t run = 1;
+    while (first + run < end) {
+        BlockRequest* next = &queue->requests[first + run];
+        if (next->write != request->write
+            || next->sector != request->sector + request->num_sectors
+            || total_sectors + next->num_sectors > BLOCK_MAX_MERGED_SECTORS) {
+            break;
+        }
+        total_sectors += next->num_sectors;
+        request = next;
+        run++;
+    }
+    return run;
+}
+
+// A run of requests on its way to the drive
+typedef struct {
+    uint8_t drive;
+    BlockRequest* requests;
+    uint32_t run;
+    uint32_t total_sectors;
+    bool write;
+    char* buffer;
+} Dispatch;
+
+// Sends a run to the drive. It may still be in flight when this
+// returns, so the channel has to be left alone until dispatchFinish.
+static void dispatchStart(Dispatch* dispatch, uint8_t drive, BlockQueue* queue, uint32_t first, uint32_t run) {
+    BlockRequest* requests = &queue->requests[first];
+    uint32_t sector = requests[0].sector;
+    uint32_t total_sectors = 0;
+    for (uint32_t i = 0; i < run; i++) {
+        total_sectors += requests[i].num_sectors;
+    }
+    
+    bool write = requests[0].write;
+    char* buffer = requests[0].buffer;
+    if (run > 1) {
+        // The requests' buffers aren't next to each other in memory,
+        // so go through one big buffer instead
+        buffer = kheapAlloc(total_sectors * IDE_SECTOR_SIZE);
+        if (write) {
+            char* iter = buffer;
+            for (uint32_t i = 0; i < run; i++) {
+                kmemcpy(iter, requests[i].buffer, requests[i].num_sectors * IDE_SECTOR_SIZE);
+                iter += requests[i].num_sectors * IDE_SECTOR_SIZE;
+            }
+        }
+        queue->stats.merged += run - 1;
+    }
+    
+    ataDriveStartTransfer(drive, buffer, total_sectors, sector, write);
+    queue->stats.dispatched++;
+    queue->stats.sectors_dispatched += total_sectors;
+    queue->head = sector + total_sectors;
+    
+    *dispatch = (Dispatch) { drive, requests, run, total_sectors, write, buffer };
+}
+
+static bool dispatchFinish(Dispatch* dispatch) {
+    bool succeeded = ataDriveFinishTransfer(dispatch->drive);
+    if (succeeded && dispatch->write) {
+        getQueue(dispatch->drive)->needs_flush = true;
+    }
+    
+    BlockRequest* requests = dispatch->requests;
+    if (!succeeded) {
+        getQueue(dispatch->drive)->stats.failed++;
+    }
+    if (dispatch->run > 1) {
+        if (!dispatch->write && succeeded) {
+            char* iter = dispatch->buffer;
+            for (uint32_t i = 0; i < dispatch->run; i++) {
+                kmemcpy(requests[i].buffer, iter, requests[i].num_sectors * IDE_SECTOR_SIZE);
+                iter += requests[i].num_sectors * IDE_SECTOR_SIZE;
+            }
+        }
+        kheapFree(dispatch->buffer);
+    }
+    for (uint32_t i = 0; i < dispatch->run; i++) {
+        if (!requests[i].write) {
+            if (requests[i].succeeded != NULL) {
+                *requests[i].succeeded = succeeded;
+            }
+        } else if (succeeded) {
+            kheapFree(requests[i].buffer);
+        } else {
+            // Our copy may be the only one left, so hang on to it
+            requests[i].failed = true;
+            requests[i].attempts++;
+        }
+    }
+    return succeeded;
+}
+
+// One-way elevator: everything at or past the head in order, then
+// back to the start of the disk for the rest. The queue is rotated
+// into that order so it can be dispatched front to back. Runs can't
+// merge across the wrap, since the sectors go backwards there.
+static void elevatorOrder(BlockQueue* queue) {
+    uint32_t split = 0;
+    while (split < queue->count && queue->requests[split].sector < queue->head) {
+        split++;
+    }
+    if (split == 0) {
+        return;
+    }
+    BlockRequest wrapped[BLOCK_QUEUE_DEPTH];
+    kmemcpy(wrapped, queue->requests, split * sizeof(BlockRequest));
+    for (uint32_t i = split; i < queue->count; i++) {
+        queue->requests[i - split] = queue->requests[i];
+    }
+    kmemcpy(&queue->requests[queue->count - split], wrapped, split * sizeof(BlockRequest));
+}
+
+// Drains the queues of the selected drives. Each channel works through
+// its drives one run at a time, and the two channels' runs are started
+// together, so a transfer on one channel is in flight while the other
+// channel is busy too.
+static bool unplugDrives(const bool selected[ATA_MAX_DRIVES]) {
+    uint32_t next[ATA_MAX_DRIVES];
+    for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        next[drive] = 0;
+        if (selected[drive] && queues[drive].count > 0) {
+            queues[drive].stats.unplugs++;
+            elevatorOrder(&queues[drive]);
+        }
+    }
+    
+    bool succeeded = true;
+    while (true) {
+        Dispatch dispatches[ATA_MAX_CHANNELS];
+        bool started[ATA_MAX_CHANNELS] = { false };
+        bool any_started = false;
+        for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+            uint8_t channel = ataDriveChannel(drive);
+            BlockQueue* queue = &queues[drive];
+            // The master's queue drains before the slave's
+            if (!selected[drive] || started[channel] || next[drive] == queue->count) {
+                continue;
+            }
+            uint32_t run = mergeableRun(queue, next[drive], queue->count);
+            dispatchStart(&dispatches[channel], drive, queue, next[drive], run);
+            next[drive] += run;
+            started[channel] = true;
+            any_started = true;
+        }
+        if (!any_started) {
+            break;
+        }
+        for (uint8_t channel = 0; channel < ATA_MAX_CHANNELS; channel++) {
+            if (started[channel] && !dispatchFinish(&dispatches[channel])) {
+                succeeded = false;
+            }
+        }
+    }
+    
+    // Writes that failed go back in the queue, in sector order, to be
+    // tried again next time. Ones that have had all their tries are
+    // dropped. This unplug has already reported them failing, and
+    // that's the last anyone hears of them.
+    for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        if (!selected[drive]) {
+            continue;
+        }
+        BlockQueue* queue = &queues[drive];
+        BlockRequest failed[BLOCK_QUEUE_DEPTH];
+        uint32_t failed_count = 0;
+        for (uint32_t i = 0; i < queue->count; i++) {
+            BlockRequest* request = &queue->requests[i];
+            if (!request->write || !request->failed) {
+                continue;
+            }
+            if (request->attempts >= BLOCK_MAX_WRITE_ATTEMPTS) {
+                kprintf("ERROR: Giving up writing sectors %u-%u on drive %u\n",
+                        request->sector, request->sector + request->num_sectors - 1, drive);
+                kheapFree(request->buffer);
+                queue->stats.dropped++;
+            } else {
+                failed[failed_count] = *request;
+                failed[failed_count].failed = false;
+                failed_count++;
+            }
+        }
+        queue->count = 0;
+        for (uint32_t i = 0; i < failed_count; i++) {
+            insertRequest(queue, failed[i]);
+        }
+    }
+    return succeeded;
+}
+
+bool blockUnplug(uint8_t drive) {
+    // Only here to catch bad drive numbers
+    getQueue(drive);
+    bool selected[ATA_MAX_DRIVES] = { false };
+    selected[drive] = true;
+    return unplugDrives(selected);
+}
+
+bool blockUnplugAll() {
+    bool selected[ATA_MAX_DRIVES];
+    for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        selected[drive] = true;
+    }
+    return unplugDrives(selected);
+}
+
+// Flushes the drive's cache if any writes reached it since last time
+static bool flushDrive(uint8_t drive) {
+    BlockQueue* queue = getQueue(drive);
+    if (!queue->needs_flush) {
+        return true;
+    }
+    if (!ataDriveFlush(drive)) {
+        return false;
+    }
+    queue->needs_flush = false;
+    queue->stats.flushes++;
+    return true;
+}
+
+bool blockFlush(uint8_t drive) {
+    bool succeeded = blockUnplug(drive);
+    if (!flushDrive(drive)) {
+        succeeded = false;
+    }
+    return succeeded;
+}
+
+bool blockFlushAll() {
+    bool succeeded = blockUnplugAll();
+    for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        if (!flushDrive(drive)) {
+            succeeded = false;
+        }
+    }
+    return succeeded;
+}
+
+bool blockRead(uint8_t drive, char* buffer, uint32_t sector, uint32_t num_sectors) {
+    bool succeeded = false;
+    if (!blockSubmitRead(drive, buffer, sector, num_sectors, &succeeded)) {
+        return false;
+    }
+    // Anything else that fails along the way is its owner's problem
+    blockUnplug(drive);
+    return succeeded;
+}
+
+bool blockWrite(uint8_t drive, const char* buffer, uint32_t sector, uint32_t num_sectors) {
+    return blockSubmitWrite(drive, buffer, sector, num_sectors);
+}
+
+BlockQueueStats blockGetStats(uint8_t drive) {
+    return getQueue(drive)->stats;
+}
+
+void blockDumpStats() {
+    for (uint8_t drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+        BlockQueueStats* stats = &queues[drive].stats;
+        if (stats->submitted == 0) {
+            continue;
+        }
+        uint32_t average = (stats->dispatched == 0)
+            ? 0 : stats->sectors_dispatched / stats->dispatched;
+        kprintf("Drive %u: %u requests, %u merged, %u commands, %u unplugs\n",
+                drive, stats->submitted, stats->merged, stats->dispatched, stats->unplugs);
+        kprintf("  Average command: %u sectors, %u pending, %u flushes, %u failed, %u dropped\n",
+                average, queues[drive].count, stats->flushes, stats->failed, stats->dropped);
+    }
+}
@@ -67,6 +67,23 @@ movl %cr3, %eax
 movl %eax, %cr3
 ret
 
+# Drops the TLB entry for the one page containing the address passed in
+.global invalidatePage
+.type invalidatePage, @function
+invalidatePage:
+mov 4(%esp), %eax
+invlpg (%eax)
+ret
+
+# Enable PGE, so mappings marked global survive CR3 reloads
+.global enableGlobalPages
+.type enableGlobalPages, @function
+enableGlobalPages:
+mov %cr4, %eax
+or $0x00000080, %eax
+mov %eax, %cr4
+ret
+
 # Function that takes in a pointer to the 
 # IDTInfo struct and loads the idt 
 
@@ -55,6 +55,15 @@ void loadCpuid() {
 	}
 }
 
+// Whether the processor supports PGE (global pages)
+bool cpuidHasGlobalPages() {
+	if(isCpuidAvailable() == 0)
+		return false;
+	
+	cpuidLoadFeatures((intptr_t)&cpuid.ecx_features, (intptr_t)&cpuid.edx_features);
+	return cpuid.edx_features & (1 << 13);
+}
+
 void cpuidPrintVendor() {
 	if(fetchCpuid()) {
         kprintf("vendor id: ");
@@ -118,8 +118,9 @@ extern void PITIRQ();
 // Keyboard Input (PC/2)
 extern void keyboardIsr(void);
 
-// Ide Controller DMA IRQ
+// Ide Controller IRQs, primary and secondary channel
 extern void ideIRQISR(void);
+extern void ideSecondaryIRQISR(void);
 
 extern void syscall_isr(void);
 
@@ -140,10 +141,10 @@ void idtInit() {
 	addIsrToIdt(0x20, &PITIRQ, 0, INTERRUPT_GATE_32);
     addIsrToIdt(0x21, keyboardIsr, 0, INTERRUPT_GATE_32);	
     
-    // Primary ATA Device after DMA transfer
+    // Primary ATA Device when a command finishes
     addIsrToIdt(0x20 + 14, &ideIRQISR, 0, INTERRUPT_GATE_32);
-    // Secondary ATA Device after DMA transfer
-    addIsrToIdt(0x20 + 15, &ideIRQISR, 0, INTERRUPT_GATE_32);
+    // Secondary ATA Device when a command finishes
+    addIsrToIdt(0x20 + 15, &ideSecondaryIRQISR, 0, INTERRUPT_GATE_32);
     
     // Loads the location of the idt into the proper CPU register
 	idtLoad(&idt_info);
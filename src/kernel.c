@@ -10,6 +10,8 @@
 #include <pci.h>
 #include <pic.h>
 #include <ata.h>
+#include <block.h>
+#include <bcache.h>
 #include <io.h>
 #include <kshell.h>
 #include <memory.h>
@@ -91,6 +93,10 @@ void kernelMain(MultibootInfo* multiboot_info, uint32_t magic) {
     kprintf("jump_to_ring3: 0x%x\n", jump_to_ring3);
     
     bool ide_initialized = ideInit();
+    if (ide_initialized) {
+        blockInit();
+        bcacheInit();
+    }
     
     jump_to_ring3(user_mode_func_test);
     
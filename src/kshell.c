@@ -7,6 +7,11 @@
 #include <keyboard_io.h>
 #include <kstdio.h>
 #include <kstdlib.h>
+#include <kheap.h>
+#include <block.h>
+#include <bcache.h>
+#include <ide.h>
+#include <sknyfs.h>
 #include "debug.h"
 
 extern char const *kb_keyset;
@@ -39,6 +44,126 @@ static void handleE0Key(MappedKey key) {
 }
 #pragma GCC diagnostic push
 
+typedef struct {
+    const char* name;
+    void (*run)(const char* args);
+} ShellCommand;
+
+static void heapDumpCommand(const char* args) {
+    (void) args;
+    kheapDump();
+}
+
+static void heapBenchCommand(const char* args) {
+    (void) args;
+    kheapBenchmark();
+}
+
+static void blockStatsCommand(const char* args) {
+    (void) args;
+    blockDumpStats();
+}
+
+static void cacheStatsCommand(const char* args) {
+    (void) args;
+    bcacheDump();
+}
+
+static void syncCommand(const char* args) {
+    (void) args;
+    if (!bcacheSync()) {
+        kprintf("Failed to write back the buffer cache\n");
+    }
+}
+
+// Benchmarks the drive given, or the primary master
+static void ataBenchCommand(const char* args) {
+    uint8_t drive = 0;
+    if (*args >= '0' && *args <= '9') {
+        drive = *args - '0';
+    }
+    ataBenchmark(drive);
+}
+
+// Formats the drive given with SknyFS and times it, with the chunk size
+// given or the default one. There's no default drive, so wiping one
+// always takes asking for it by number.
+static void formatBenchCommand(const char* args) {
+    if (*args < '0' || *args > '9') {
+        kprintf("Usage: formatbench <drive> [chunk size]\n");
+        return;
+    }
+    uint8_t drive = *args - '0';
+    args++;
+    while (*args == ' ') {
+        args++;
+    }
+    uint32_t chunk_size = 0;
+    while (*args >= '0' && *args <= '9') {
+        chunk_size = (chunk_size * 10) + (*args - '0');
+        args++;
+    }
+    if (chunk_size == 0) {
+        chunk_size = SKNY_DEFAULT_CHUNK_SIZE;
+    }
+    sknyFormatBenchmark(drive, chunk_size);
+}
+
+// Shows the read-ahead limit, or sets it if given a number of sectors
+static void readAheadCommand(const char* args) {
+    if (*args < '0' || *args > '9') {
+        kprintf("Read-ahead: up to %u sectors\n", bcacheGetReadAhead());
+        return;
+    }
+    uint32_t sectors = 0;
+    while (*args >= '0' && *args <= '9') {
+        sectors = (sectors * 10) + (*args - '0');
+        args++;
+    }
+    bcacheSetReadAhead(sectors);
+    kprintf("Read-ahead: up to %u sectors\n", bcacheGetReadAhead());
+}
+
+static const ShellCommand shell_commands[] = {
+    { "heapdump",    heapDumpCommand },
+    { "heapbench",   heapBenchCommand },
+    { "blockstats",  blockStatsCommand },
+    { "cachestats",  cacheStatsCommand },
+    { "sync",        syncCommand },
+    { "readahead",   readAheadCommand },
+    { "atabench",    ataBenchCommand },
+    { "formatbench", formatBenchCommand },
+};
+
+#define SHELL_COMMAND_COUNT (sizeof(shell_commands) / sizeof(shell_commands[0]))
+
+// Splits the line into a command name and its arguments, and runs the
+// matching command. Returns false if there is no such command.
+static bool runCommand(char* line) {
+    while (*line == ' ') {
+        line++;
+    }
+    char* args = line;
+    while (*args != '\0' && *args != ' ' && *args != '\n') {
+        args++;
+    }
+    size_t name_length = args - line;
+    while (*args == ' ' || *args == '\n') {
+        args++;
+    }
+    if (name_length == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < SHELL_COMMAND_COUNT; i++) {
+        const char* name = shell_commands[i].name;
+        if (kstrlen(name) == name_length && kmemcmp(name, line, name_length) == 0) {
+            shell_commands[i].run(args);
+            return true;
+        }
+    }
+    return false;
+}
+
 void kShellStart() {
 	kbInit();
 	while(1) {
@@ -46,6 +171,9 @@ void kShellStart() {
         char buffer[512];
         kmemset(buffer, 0, sizeof(buffer));
         kbGetLine(buffer);
-        kprintf("\n%s\n", buffer);
+        kprintf("\n");
+        if (!runCommand(buffer)) {
+            kprintf("Unknown command: %s\n", buffer);
+        }
     }
 }
@@ -2,13 +2,30 @@
 #include <stdint.h>
 #include <memory.h>
 #include <kstdio.h>
+#include <kstdlib.h>
+#include <cpuid.h>
 
-const uint32_t FRAME_SIZE = 4 * 1024 * 1024;
+// The kernel's low memory is identity mapped with a single 4 MiB page.
+// Everything else is mapped on demand in 4 KiB pages.
+const uint32_t LARGE_PAGE_SIZE = 4 * 1024 * 1024;
 
 // The Page Directory maps sections of the virtual address space into
 // equivalent sections of the physical address space.
 static PageDirEntry page_directory[1024] __attribute__((aligned(4096)));
 
+// The last page directory entry points back at the page directory
+// itself, so the processor treats the directory as the page table for
+// the top 4 MiB of the address space. That puts every page table at
+// PAGE_TABLES_ADDRESS + (index * PAGE_SIZE), without having to map
+// each one separately.
+#define RECURSIVE_ENTRY     1023
+#define PAGE_TABLES_ADDRESS 0xffc00000
+#define PAGE_TABLE(vpn) ((PageTableEntry*) (PAGE_TABLES_ADDRESS + ((vpn) * PAGE_SIZE)))
+
+#define PAGE_PRESENT (1 << 0)
+#define PAGE_LARGE   (1 << 7)
+#define PAGE_GLOBAL  (1 << 8)
+
 typedef enum {
     PAGE_SIZE_4_KIB,
     PAGE_SIZE_4_MIB
@@ -24,54 +41,51 @@ typedef enum {
     PAGE_USER_AND_SUPERVISOR
 } PagePermission;
 
+// `address` is the physical address of either the 4 MiB frame being
+// mapped, or of the page table this entry refers to
 static PageDirEntry constructPageDirEntry(
-                                          uint32_t pfn,
+                                          uint32_t address,
                                           PageSize page_size,
                                           PageRW rw,
                                           PagePermission permission
                                           ) {
     PageDirEntry entry = 0;
     // Sanity check (slow, but we're new and bugs are scary)
-    if (pfn >= 0x40000) {
-        kprintf("constructPageDirEntry received a bad PFN!\n");
+    uint32_t alignment = (page_size == PAGE_SIZE_4_MIB) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    if (address % alignment != 0) {
+        kprintf("constructPageDirEntry received a misaligned address!\n");
         while (true);
     }
-    entry |= pfn << 22; // bits 31:22
+    entry |= address; // bits 31:22 (4 MiB) or 31:12 (page table)
     entry |= (page_size == PAGE_SIZE_4_MIB)
-        ? (1 << 7) : 0;
+        ? PAGE_LARGE : 0;
     entry |= (rw == PAGE_READ_WRITE)
         ? (1 << 1) : 0;
     entry |= (permission == PAGE_USER_AND_SUPERVISOR)
         ? (1 << 2) : 0;
-    entry |= 1; // Mark present
+    entry |= PAGE_PRESENT;
     return entry;
 }
 
-static PageDirEntry constructEmptyPageDirEntry(
-                                               PageSize page_size,
-                                               PageRW rw,
-                                               PagePermission permission
-                                               ) {
-    PageDirEntry entry =
-        constructPageDirEntry(0, page_size, rw, permission);
-    // Clear present bit
-    entry &= ~1;
+static PageTableEntry constructPageTableEntry(
+                                              uint32_t address,
+                                              PageRW rw,
+                                              PagePermission permission
+                                              ) {
+    PageTableEntry entry = 0;
+    if (address % PAGE_SIZE != 0) {
+        kprintf("constructPageTableEntry received a misaligned address!\n");
+        while (true);
+    }
+    entry |= address; // bits 31:12
+    entry |= (rw == PAGE_READ_WRITE)
+        ? (1 << 1) : 0;
+    entry |= (permission == PAGE_USER_AND_SUPERVISOR)
+        ? (1 << 2) : 0;
+    entry |= PAGE_PRESENT;
     return entry;
 }
 
-
-// This is a bitfield that keeps track of which page frames are in
-// use, versus which ones are still free. This DOES NOT keep track of
-// any parts of physical memory that are completely unavailable
-// (i.e. not backed up by actual RAM). That is managed by the
-// Physical_Memory_Regions (see below). Those areas of memory are just
-// marked permanently free
-static union {
-    uint8_t  bytes[128];
-    uint16_t halfwords[64];
-    uint32_t words[32];
-} page_frame_map;
-
 // Virtual Page Number: VPN
 // This is the part of the address that indexes the page directory.
 // The page directory has 1024 entries, so the top 10 bits are the VPN.
@@ -79,12 +93,18 @@ static uint32_t getVirtualFrameNumber(uint32_t virtual_address) {
     return virtual_address >> 22;
 }
 
+// This is the part of the address that indexes a page table: the 10
+// bits below the VPN.
+static uint32_t getPageTableIndex(uint32_t virtual_address) {
+    return (virtual_address >> 12) & 0x3ff;
+}
+
 // Physical Frame Number: PFN
 //  This is the part of the address that indexes physical memory by frame.
-//  We divide memory into 4 MiB frames, each of which is indexed by the lower 22 bits.
-//  Therefore, the top 10 bits are the PFN.
+//  We divide memory into 4 KiB frames, each of which is indexed by the lower 12 bits.
+//  Therefore, the top 20 bits are the PFN.
 static uint32_t get_physical_frame_number(uint32_t physical_address) {
-    return physical_address >> 22;
+    return physical_address >> 12;
 }
 
 // The PhysicalMemoryRegions describe which parts of the 32-bit
@@ -98,72 +118,320 @@ typedef struct {
 static Physical_Memory_Region physical_memory_regions[MAX_PHYSICAL_MEMORY_REGIONS];
 static uint32_t physical_memory_region_count;
 
-static bool is_frame_used(uint32_t pfn) {
-    return page_frame_map.words[pfn / 32] & (1 << (pfn % 32));
+extern void flush_tlb(); // in boot.s for now
+extern void invalidatePage(uint32_t virtual_address); // in boot.s for now
+extern void enableGlobalPages(); // in boot.s for now
+
+// Changing a page table entry only needs that one page dropped from
+// the TLB, so instead of reloading CR3 (and throwing away every
+// translation) we invlpg just the pages that changed. Between
+// tlbBatchBegin and tlbBatchEnd the pages are queued up instead, so a
+// bulk change does all of its invalidation in one go at the end.
+// Anything that touches a page directory entry still invalidates
+// straight away, since the processor may walk through it.
+#define TLB_BATCH_MAX 64
+static uint32_t tlb_batch_pages[TLB_BATCH_MAX];
+static uint32_t tlb_batch_count;
+static uint32_t tlb_batch_depth;
+static bool tlb_batch_overflowed;
+
+void tlbBatchBegin() {
+    tlb_batch_depth++;
 }
 
-static void setFrameUsed(uint32_t pfn) {
-    page_frame_map.words[pfn / 32] |= (1 << (pfn % 32));
+void tlbBatchEnd() {
+    tlb_batch_depth--;
+    if (tlb_batch_depth != 0) {
+        return;
+    }
+    if (tlb_batch_overflowed) {
+        // Too many pages to be worth doing one by one
+        flush_tlb();
+    } else {
+        for (uint32_t i = 0; i < tlb_batch_count; i++) {
+            invalidatePage(tlb_batch_pages[i]);
+        }
+    }
+    tlb_batch_count = 0;
+    tlb_batch_overflowed = false;
 }
 
-extern void flush_tlb(); // in boot.s for now
+static void queueInvalidatePage(uint32_t virtual_address) {
+    if (tlb_batch_depth == 0) {
+        invalidatePage(virtual_address);
+    } else if (tlb_batch_count < TLB_BATCH_MAX) {
+        tlb_batch_pages[tlb_batch_count] = virtual_address;
+        tlb_batch_count++;
+    } else {
+        tlb_batch_overflowed = true;
+    }
+}
 
-// When a page fault occurs, this is called. It finds a frame of
-// physical memory that is so far unused, and maps the page directory
-// entry corresponding to the fault to this frame. It also marks that
-// frame as used, so it doesn't get reused in the future.
-extern uint32_t getFaultAddress(); // in boot.s for now
-void handle_page_fault() {
-    uint32_t fault_address = getFaultAddress();
-    uint32_t pfn;
-    // Find an unallocated page frame
-    for (uint8_t region_index = 0; region_index < physical_memory_region_count; region_index++) {
-        Physical_Memory_Region* region = physical_memory_regions + region_index;
-        
-        // Frames must be aligned to the frame size, and there must be
-        // enough space for the whole frame. Thus we calculate an
-        // offset from the start of the region, and the maximum number
-        // of blocks that it can fit.
-        
-        uint32_t frame_start = region->address & ~(FRAME_SIZE - 1);
-        frame_start += FRAME_SIZE;
-        
-        if (frame_start > region->address + region->size) {
-            // This region isn't big enough for even a single frame!
-            // Low memory (kernel memory) should fall into this category
-            continue;
+//
+// Physical frames are handed out by a buddy allocator. A block of
+// order n is 2^n contiguous 4 KiB frames, aligned to its own size, and
+// its "buddy" is the neighbouring block it was split from. Freeing a
+// block merges it back with its buddy for as long as the buddy is free
+// too, so both allocating and freeing take at most MAX_FRAME_ORDER
+// steps.
+//
+
+// Each order has a doubly linked list of free blocks. The links are
+// kept inside the free blocks themselves, as physical addresses.
+typedef struct {
+    uint32_t magic_number;
+    uint32_t order;
+    uint32_t next; // 0 for none (frame 0 is never free)
+    uint32_t prev;
+} FreeFrameBlock;
+
+#define FREE_FRAME_MAGIC 0xf4ee0b1c
+
+static uint32_t free_frame_lists[MAX_FRAME_ORDER + 1];
+static uint32_t free_frame_counts[MAX_FRAME_ORDER + 1];
+
+// One bit per 4 KiB frame of the 32-bit physical address space, set
+// if that frame is the first frame of a free block. Merging has to
+// know if a buddy is free before it can trust the buddy's header.
+#define FRAME_COUNT (1024 * 1024)
+static uint32_t free_block_map[FRAME_COUNT / 32];
+
+static bool isFreeBlockHead(uint32_t pfn) {
+    return free_block_map[pfn / 32] & (1 << (pfn % 32));
+}
+
+static void setFreeBlockHead(uint32_t pfn, bool is_head) {
+    if (is_head) {
+        free_block_map[pfn / 32] |= (1 << (pfn % 32));
+    } else {
+        free_block_map[pfn / 32] &= ~(1 << (pfn % 32));
+    }
+}
+
+// Free blocks aren't mapped anywhere, so their headers are reached
+// through a couple of fixed "window" pages, whose page table entries
+// get pointed at whichever frame we need to look at.
+#define FRAME_WINDOW_ENTRY   1022
+#define FRAME_WINDOW_ADDRESS 0xff800000
+#define FRAME_WINDOW_SLOTS   2
+static PageTableEntry frame_window_table[1024] __attribute__((aligned(4096)));
+static uint32_t frame_window_mapped[FRAME_WINDOW_SLOTS];
+
+static FreeFrameBlock* mapFrameWindow(uint32_t slot, uint32_t physical_address) {
+    if (frame_window_mapped[slot] != physical_address) {
+        frame_window_table[slot] = constructPageTableEntry(
+                                                           physical_address, PAGE_READ_WRITE, PAGE_SUPERVISOR_ONLY
+                                                           );
+        frame_window_mapped[slot] = physical_address;
+        invalidatePage(FRAME_WINDOW_ADDRESS + (slot * PAGE_SIZE));
+    }
+    return (FreeFrameBlock*) (FRAME_WINDOW_ADDRESS + (slot * PAGE_SIZE));
+}
+
+static void pushFreeBlock(uint32_t address, uint32_t order) {
+    FreeFrameBlock* block = mapFrameWindow(0, address);
+    block->magic_number = FREE_FRAME_MAGIC;
+    block->order = order;
+    block->prev = 0;
+    block->next = free_frame_lists[order];
+    if (block->next != 0) {
+        mapFrameWindow(1, block->next)->prev = address;
+    }
+    free_frame_lists[order] = address;
+    free_frame_counts[order]++;
+    setFreeBlockHead(get_physical_frame_number(address), true);
+}
+
+static void removeFreeBlock(uint32_t address, uint32_t order) {
+    FreeFrameBlock* block = mapFrameWindow(0, address);
+    uint32_t next = block->next;
+    uint32_t prev = block->prev;
+    block->magic_number = 0;
+    if (prev != 0) {
+        mapFrameWindow(1, prev)->next = next;
+    } else {
+        free_frame_lists[order] = next;
+    }
+    if (next != 0) {
+        mapFrameWindow(1, next)->prev = prev;
+    }
+    free_frame_counts[order]--;
+    setFreeBlockHead(get_physical_frame_number(address), false);
+}
+
+static bool isFreeBlockOfOrder(uint32_t address, uint32_t order) {
+    if (!isFreeBlockHead(get_physical_frame_number(address))) {
+        return false;
+    }
+    FreeFrameBlock* block = mapFrameWindow(0, address);
+    return block->magic_number == FREE_FRAME_MAGIC && block->order == order;
+}
+
+// Allocates 2^order contiguous frames, aligned to their size, and
+// returns the physical address of the first one
+uint32_t allocFrames(uint32_t order) {
+    uint32_t current_order = order;
+    while (current_order <= MAX_FRAME_ORDER && free_frame_lists[current_order] == 0) {
+        current_order++;
+    }
+    if (current_order > MAX_FRAME_ORDER) {
+        // Could not allocate page frame
+        kprintf("Ran out of physical memory!\n");
+        while (1);
+    }
+    
+    uint32_t address = free_frame_lists[current_order];
+    removeFreeBlock(address, current_order);
+    // Split the block down to size, handing the upper halves back
+    while (current_order > order) {
+        current_order--;
+        pushFreeBlock(address + (PAGE_SIZE << current_order), current_order);
+    }
+    return address;
+}
+
+// Gives 2^order frames, previously returned by allocFrames with the
+// same order, back to the allocator
+void freeFrames(uint32_t address, uint32_t order) {
+    if (address % (PAGE_SIZE << order) != 0 || isFreeBlockHead(get_physical_frame_number(address))) {
+        kprintf("Passed bad frame to freeFrames (%x)!\n", address);
+        while (1);
+    }
+    while (order < MAX_FRAME_ORDER) {
+        uint32_t buddy = address ^ (PAGE_SIZE << order);
+        if (!isFreeBlockOfOrder(buddy, order)) {
+            break;
         }
-        
-        uint32_t remaining_size = region->size - (frame_start - region->address);
-        
-        uint8_t frame_count = remaining_size / FRAME_SIZE;
-        //kprintf("frame start: %x; frame count: %d\n", frame_start, frame_count);
-        for (uint32_t frame = 0; frame < frame_count; frame++) {
-            uint32_t address = frame_start + frame * FRAME_SIZE;
-            pfn = get_physical_frame_number(address);
-            if (!is_frame_used(pfn)) {
-                goto found_id;
-            }
+        removeFreeBlock(buddy, order);
+        address &= ~(PAGE_SIZE << order);
+        order++;
+    }
+    pushFreeBlock(address, order);
+}
+
+// Hands every whole frame of a region of RAM to the buddy allocator,
+// in the biggest aligned blocks that fit
+static void addFramesToAllocator(uint32_t start, uint32_t end) {
+    start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    end &= ~(PAGE_SIZE - 1);
+    while (start < end) {
+        uint32_t order = MAX_FRAME_ORDER;
+        while (start % (PAGE_SIZE << order) != 0 || start + (PAGE_SIZE << order) > end) {
+            order--;
         }
+        pushFreeBlock(start, order);
+        start += PAGE_SIZE << order;
     }
-    // Could not allocate page frame
-    kprintf("Ran out of physical memory!");
-    while (1);
+}
+
+// How many entries of each page table are in use, so that a page
+// table can be given back once it's empty
+static uint16_t page_table_entry_counts[1024];
+
+// Points the page at `virtual_address` at a brand new, zeroed frame,
+// creating the page table for that part of the address space first if
+// there isn't one yet.
+void mapFreshPage(uint32_t virtual_address) {
+    uint32_t vpn = getVirtualFrameNumber(virtual_address);
+    uint32_t table_index = getPageTableIndex(virtual_address);
     
-    found_id:
-    // Set frame as allocated
-    setFrameUsed(pfn);
+    if (vpn == 0 || vpn >= FRAME_WINDOW_ENTRY) {
+        kprintf("Can't map pages at %x!\n", virtual_address);
+        while (1);
+    }
+    
+    PageTableEntry* page_table = PAGE_TABLE(vpn);
+    if ((page_directory[vpn] & PAGE_PRESENT) == 0) {
+        // No page table covers this address yet, so make one
+        page_directory[vpn] = constructPageDirEntry(
+                                                    allocFrames(0), PAGE_SIZE_4_KIB, PAGE_READ_WRITE, PAGE_USER_AND_SUPERVISOR
+                                                    );
+        invalidatePage((uint32_t) page_table);
+        kmemset(page_table, 0, PAGE_SIZE);
+        page_table_entry_counts[vpn] = 0;
+    } else if (page_table[table_index] & PAGE_PRESENT) {
+        // The page is there, so this was a protection violation
+        kprintf("Page protection fault at %x!\n", virtual_address);
+        while (1);
+    }
     
-    // Now, update the page directory to reference this frame
-    uint32_t vpn = getVirtualFrameNumber(fault_address);
-	page_directory[vpn] = constructPageDirEntry(
-                                                pfn, PAGE_SIZE_4_MIB, PAGE_READ_WRITE, PAGE_USER_AND_SUPERVISOR
-                                                );
+	page_table[table_index] = constructPageTableEntry(
+                                                      allocFrames(0), PAGE_READ_WRITE, PAGE_USER_AND_SUPERVISOR
+                                                      );
+    page_table_entry_counts[vpn]++;
     
     // Invalidate the TLB, so that the processor will reflect these changes
-    flush_tlb(); 
+    invalidatePage(virtual_address);
+    
+    // Nobody should get to see what the frame was used for before
+    kmemset((void*) (virtual_address & ~(PAGE_SIZE - 1)), 0, PAGE_SIZE);
+}
+
+bool isPageMapped(uint32_t virtual_address) {
+    uint32_t vpn = getVirtualFrameNumber(virtual_address);
+    if ((page_directory[vpn] & PAGE_PRESENT) == 0) {
+        return false;
+    }
+    if (page_directory[vpn] & PAGE_LARGE) {
+        return true;
+    }
+    return PAGE_TABLE(vpn)[getPageTableIndex(virtual_address)] & PAGE_PRESENT;
+}
+
+// Looks up the physical address `virtual_address` is mapped to, for
+// handing buffers to hardware that doesn't go through paging
+uint32_t virtualToPhysical(uint32_t virtual_address) {
+    uint32_t vpn = getVirtualFrameNumber(virtual_address);
+    if (!isPageMapped(virtual_address)) {
+        kprintf("Tried to translate an address that isn't mapped (%x)!\n", virtual_address);
+        while (1);
+    }
+    if (page_directory[vpn] & PAGE_LARGE) {
+        return (page_directory[vpn] & ~(LARGE_PAGE_SIZE - 1)) | (virtual_address & (LARGE_PAGE_SIZE - 1));
+    }
+    PageTableEntry entry = PAGE_TABLE(vpn)[getPageTableIndex(virtual_address)];
+    return (entry & ~(PAGE_SIZE - 1)) | (virtual_address & (PAGE_SIZE - 1));
+}
+
+// Removes the mapping for the page at `virtual_address` and gives its
+// frame back. Once a page table has nothing left in it, it goes too.
+void unmapPage(uint32_t virtual_address) {
+    uint32_t vpn = getVirtualFrameNumber(virtual_address);
+    uint32_t table_index = getPageTableIndex(virtual_address);
+    
+    PageTableEntry* page_table = PAGE_TABLE(vpn);
+    if (vpn == 0 || vpn >= FRAME_WINDOW_ENTRY
+        || (page_directory[vpn] & PAGE_PRESENT) == 0
+        || (page_table[table_index] & PAGE_PRESENT) == 0) {
+        kprintf("Tried to unmap a page that isn't mapped (%x)!\n", virtual_address);
+        while (1);
+    }
     
-    //kprintf("Mapped page %d to frame %d (word %d, position %d)\n", vpn, pfn, pfn / 32, pfn % 32);
+    freeFrames(page_table[table_index] & ~(PAGE_SIZE - 1), 0);
+    page_table[table_index] = 0;
+    page_table_entry_counts[vpn]--;
+    
+    if (page_table_entry_counts[vpn] == 0) {
+        uint32_t page_table_frame = page_directory[vpn] & ~(PAGE_SIZE - 1);
+        page_directory[vpn] = 0;
+        invalidatePage(virtual_address);
+        invalidatePage((uint32_t) page_table);
+        freeFrames(page_table_frame, 0);
+    } else {
+        queueInvalidatePage(virtual_address);
+    }
+}
+
+// When a page fault occurs, this is called. It maps the faulting page
+// to a fresh 4 KiB frame of physical memory.
+extern uint32_t getFaultAddress(); // in boot.s for now
+void handle_page_fault() {
+    uint32_t fault_address = getFaultAddress();
+    if (getVirtualFrameNumber(fault_address) == RECURSIVE_ENTRY) {
+        kprintf("Page fault in the page table area (%x)!\n", fault_address);
+        while (1);
+    }
+    mapFreshPage(fault_address);
 }
 
 typedef struct {
@@ -196,7 +464,9 @@ void loadPhysicalMemoryRegionDescriptors(MultibootInfo* multiboot_info) {
                 region->base_addr_low,
                 region->base_addr_low + region->length_low
                 );
-        if (region->region_type == 1) {
+        // Anything above 4 GiB is out of reach on 32-bit anyway
+        if (region->region_type == 1 && region->base_addr_high == 0
+            && physical_memory_region_count < MAX_PHYSICAL_MEMORY_REGIONS) {
             physical_memory_regions[physical_memory_region_count] = (Physical_Memory_Region)
             { region->base_addr_low, region->length_low };
             physical_memory_region_count += 1;
@@ -209,40 +479,77 @@ void loadPhysicalMemoryRegionDescriptors(MultibootInfo* multiboot_info) {
 
 extern void enablePaging(void*); // in boot.s for now
 
-// Setting this bit allows us to use huge pages that span 4 MiB of
-// virtual address space, rather than cascading from the page
-// directory into smaller page tables that index 4 KiB of virtual
-// address space.
-const uint32_t PS_BIT = (1<<7);
-
 void setupPaging() {
     //  Zero the page directory entirely
-    //  We're setting proper bits on these unused entries, but we
-    //  really don't need to. The OS will never look at an entry until
-    //  it's marked present.
+    //  The OS will never look at an entry until it's marked present.
     for (int i = 0; i < 1024; i++) {
         page_directory[i] = 0;
-        /*
-        page_directory[i] = constructEmptyPageDirEntry(
-            PAGE_SIZE_4_MIB,
-            PAGE_READ_WRITE,
-            PAGE_USER_AND_SUPERVISOR
-            );*/
     }
     
     // Map low memory (first 4MB) (this is what we're operating under)
     page_directory[0] = constructPageDirEntry(
                                               0, PAGE_SIZE_4_MIB, PAGE_READ_WRITE, PAGE_USER_AND_SUPERVISOR
                                               );
-    
-    // Zero out our physical page frame map (no pages allocated)
-    for (int i = 0; i < 32; i++) {
-        page_frame_map.words[i] = 0;
+    // The kernel mapping never changes, so if we can, mark it global
+    // to keep its TLB entries around across address space switches
+    bool global_pages = cpuidHasGlobalPages();
+    if (global_pages) {
+        page_directory[0] |= PAGE_GLOBAL;
     }
     
-    // Except for low memory, again
-    page_frame_map.words[0] |= (1 << 0);
+    // Map the page directory into itself, so that page tables can be
+    // reached through PAGE_TABLES_ADDRESS. Low memory is identity
+    // mapped, so the directory's virtual address is its physical one.
+    page_directory[RECURSIVE_ENTRY] = constructPageDirEntry(
+                                                            (uint32_t) page_directory, PAGE_SIZE_4_KIB, PAGE_READ_WRITE, PAGE_SUPERVISOR_ONLY
+                                                            );
+    
+    // Free frames are looked at through the frame window, which needs
+    // its page table in place before paging is on
+    for (int i = 0; i < 1024; i++) {
+        frame_window_table[i] = 0;
+    }
+    for (int i = 0; i < FRAME_WINDOW_SLOTS; i++) {
+        frame_window_mapped[i] = 0;
+    }
+    page_directory[FRAME_WINDOW_ENTRY] = constructPageDirEntry(
+                                                               (uint32_t) frame_window_table, PAGE_SIZE_4_KIB, PAGE_READ_WRITE, PAGE_SUPERVISOR_ONLY
+                                                               );
     
     // Finally we can actually enable paging
 	enablePaging(page_directory);
+    if (global_pages) {
+        enableGlobalPages();
+    }
+    tlb_batch_count = 0;
+    tlb_batch_depth = 0;
+    tlb_batch_overflowed = false;
+    
+    // Now hand all of RAM outside of low memory to the frame allocator
+    for (uint32_t order = 0; order <= MAX_FRAME_ORDER; order++) {
+        free_frame_lists[order] = 0;
+        free_frame_counts[order] = 0;
+    }
+    kmemset(free_block_map, 0, sizeof(free_block_map));
+    for (uint32_t region_index = 0; region_index < physical_memory_region_count; region_index++) {
+        Physical_Memory_Region* region = physical_memory_regions + region_index;
+        uint32_t start = region->address;
+        uint32_t end = region->address + region->size;
+        if (end <= LARGE_PAGE_SIZE) {
+            continue;
+        }
+        if (start < LARGE_PAGE_SIZE) {
+            start = LARGE_PAGE_SIZE;
+        }
+        addFramesToAllocator(start, end);
+    }
+}
+
+void physicalMemoryDump() {
+    uint32_t free_total = 0;
+    for (uint32_t order = 0; order <= MAX_FRAME_ORDER; order++) {
+        kprintf("Order %u (%u KiB): %u free blocks\n", order, (PAGE_SIZE << order) / 1024, free_frame_counts[order]);
+        free_total += free_frame_counts[order] << order;
+    }
+    kprintf("Free frames: %u (%u KiB)\n", free_total, free_total * (PAGE_SIZE / 1024));
 }
@@ -1,3 +1,134 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <io.h>
+#include <kstdio.h>
+#include <pci.h>
+
+/*
+	PCI configuration space is reached through two I/O ports. The
+	address of the register we want (bus, device, function and offset)
+	is written to CONFIG_ADDRESS, and the register's 32 bits can then be
+	read from or written to CONFIG_DATA.
+*/
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_REG_COMMAND       0x04
+#define PCI_REG_BAR0          0x10
+#define PCI_REG_SECONDARY_BUS 0x19
+
+#define PCI_COMMAND_IO_SPACE   (1<<0)
+#define PCI_COMMAND_BUS_MASTER (1<<2)
+
+static uint32_t pciConfigAddress(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+	return (uint32_t)((1u << 31) | (bus << 16) | ((slot & 0x1F) << 11)
+					  | ((func & 0x07) << 8) | (offset & 0xFC));
+}
+
+uint32_t pciConfigReadLong(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+	outl(PCI_CONFIG_ADDRESS, pciConfigAddress(bus, slot, func, offset));
+	return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pciConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+	uint32_t data = pciConfigReadLong(bus, slot, func, offset);
+	return (uint16_t)((data >> ((offset & 2) * 8)) & 0xFFFF);
+}
+
+static uint8_t pciConfigReadByte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+	uint32_t data = pciConfigReadLong(bus, slot, func, offset);
+	return (uint8_t)((data >> ((offset & 3) * 8)) & 0xFF);
+}
+
+void pciConfigWriteLong(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+	outl(PCI_CONFIG_ADDRESS, pciConfigAddress(bus, slot, func, offset));
+	outl(PCI_CONFIG_DATA, value);
+}
+
+static void pciConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value) {
+	uint32_t data = pciConfigReadLong(bus, slot, func, offset);
+	uint32_t shift = (offset & 2) * 8;
+	data &= ~(0xFFFF << shift);
+	data |= ((uint32_t) value) << shift;
+	pciConfigWriteLong(bus, slot, func, offset, data);
+}
+
+PCIDevice pciGetDevice(uint8_t bus, uint8_t device, uint8_t function) {
+	PCIDevice pd;
+	pd.bus = bus;
+	pd.device = device;
+	pd.function = function;
+
+	uint32_t reg = pciConfigReadLong(bus, device, function, 0x00);
+	pd.vendor_id = reg & 0xFFFF;
+	pd.device_id = reg >> 16;
+
+	reg = pciConfigReadLong(bus, device, function, 0x04);
+	pd.command = reg & 0xFFFF;
+	pd.status = reg >> 16;
+
+	reg = pciConfigReadLong(bus, device, function, 0x08);
+	pd.revision_id = reg & 0xFF;
+	pd.prog_if = (reg >> 8) & 0xFF;
+	pd.sub_class = (reg >> 16) & 0xFF;
+	pd.class_code = reg >> 24;
+
+	reg = pciConfigReadLong(bus, device, function, 0x0C);
+	pd.cache_line_size = reg & 0xFF;
+	pd.latency_timer = (reg >> 8) & 0xFF;
+	pd.header_type = (reg >> 16) & 0xFF;
+	pd.bist = reg >> 24;
+
+	reg = pciConfigReadLong(bus, device, function, 0x3C);
+	pd.interrupt_line = reg & 0xFF;
+	pd.interrupt_pin = (reg >> 8) & 0xFF;
+
+	return pd;
+}
+
+uint32_t pciReadBar(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar_num) {
+	return pciConfigReadLong(bus, device, function, PCI_REG_BAR0 + bar_num * 4);
+}
+
+// Lets the device start its own memory transactions (needed for DMA)
+void pciEnableBusMastering(PCIDevice pd) {
+	uint16_t command = pciConfigReadWord(pd.bus, pd.device, pd.function, PCI_REG_COMMAND);
+	command |= PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER;
+	pciConfigWriteWord(pd.bus, pd.device, pd.function, PCI_REG_COMMAND, command);
+}
+
+static uint8_t pciGetSecondaryBus(uint8_t bus, uint8_t device, uint8_t func) {
+	return pciConfigReadByte(bus, device, func, PCI_REG_SECONDARY_BUS);
+}
+
+// Finds the first function on any bus with the given class and
+// subclass. Returns false if there isn't one.
+bool pciFindDevice(uint8_t class_code, uint8_t sub_class, PCIDevice* found) {
+	for(int bus = 0; bus < 256; bus++) {
+		for(uint8_t device = 0; device < 32; device++) {
+			PCIDevice pd = pciGetDevice(bus, device, 0);
+			if(pd.vendor_id == 0xffff)
+				continue;
+			uint8_t num_functions = (pd.header_type & 0x80) ? 8 : 1;
+			for(uint8_t function = 0; function < num_functions; function++) {
+				if(function != 0)
+					pd = pciGetDevice(bus, device, function);
+				if(pd.vendor_id != 0xffff && pd.class_code == class_code
+				   && pd.sub_class == sub_class) {
+					*found = pd;
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+void pciCheckFunction(uint8_t bus, uint8_t device, uint8_t func) {
+	PCIDevice pd = pciGetDevice(bus, device, func);
+	// PCI-to-PCI bridges have another bus behind them
+	if(pd.class_code == 0x06 && pd.sub_class == 0x04) {
 		uint8_t secondary_bus = pciGetSecondaryBus(bus, device, func);
 		pciCheckBus(secondary_bus);
 	}
@@ -9,18 +140,6 @@ void pciCheckBus(uint8_t bus) {
 		pciCheckDevice(bus, device);
 }
 
-static void printBar(PCIDevice pd, uint32_t bar, uint8_t bar_num, char* padding){
-	uint32_t amt_mem = getBarMemAmt(pd, bar_num);
-	if(bar & 1) { // I/O Space BAR Layout
-		uint32_t addr = bar & 0XFFFFFFFC;	
-		kprintf("%sI/O addr: 0x%x\n", padding, addr);
-	}else { // Memory Space BAR Layout
-		uint32_t addr = bar & 0xFFFFFFF0;
-		kprintf("%sMem. Space addr: 0x%x\n", padding, addr);
-	}
-		kprintf("%sAmt. Mem. Needed: 0x%x\n", padding, amt_mem);
-}
-
 static void printDevice(PCIDevice pd, char* padding){
 	kprintf("%sVendorID:      0x%x\n", padding, pd.vendor_id);
 	kprintf("%s  DeviceID:    0x%x\n", padding, pd.device_id);
@@ -32,17 +151,6 @@ static void printDevice(PCIDevice pd, char* padding){
     kprintf("%s  IRQ Line:    0x%x\n", padding, pd.interrupt_line);
 }
 
-static void handleDistController(PCIDevice pd) {
-    uint32_t bars[6];
-	bars[0] = pciReadBar(pd.bus, pd.device, pd.function, 0);
-	bars[1] = pciReadBar(pd.bus, pd.device, pd.function, 1);
-	bars[2] = pciReadBar(pd.bus, pd.device, pd.function, 2);
-	bars[3] = pciReadBar(pd.bus, pd.device, pd.function, 3);
-	bars[4] = pciReadBar(pd.bus, pd.device, pd.function, 4);
-	bars[5] = pciReadBar(pd.bus, pd.device, pd.function, 5);
-	//ideInitialize(bars);	
-}
-
 void pciCheckDevice(uint8_t bus, uint8_t device) {
 	uint8_t function = 0;
 
@@ -74,9 +182,6 @@ void pciCheckDevice(uint8_t bus, uint8_t device) {
 
 				pciCheckFunction(bus, device, function);
 
-				if(tmp_pd.class_code == 0x01 && tmp_pd.sub_class == 0x01)
-					handleDistController(tmp_pd);
-
 #if DEBUG
 				kprintf("Valid VendorID: %x, DeviceId: 0x%x\n", vendor_id, device_id);
 #endif
@@ -3,10 +3,16 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
-#include <ata.h>
+#include <bcache.h>
+#include <block.h>
+#include <ide.h>
+#include <kheap.h>
 #include <kstdio.h>
+#include <kstdlib.h>
 #include <sknyfs.h>
+#include <timer.h>
 
 // These types make it more clear what numbers indicate what.
 typedef uint32_t ChunkLocation;    // Indexes disk by chunk
@@ -15,32 +21,95 @@ typedef uint32_t AbsoluteLocation; // Indexes disk by byte
 
 typedef uint32_t FileIndex; // Indexes file map
 
-// Must be a multiple of IDE_SECTOR_SIZE! (512 bytes)
-// Must be a multiple of sizeof(FileMetadata)! (256 bytes)
-//#define CHUNK_SIZE (16 * 1024 * 1024)
-#define CHUNK_SIZE 1024
+#define SUPERBLOCK_MAGIC   0x594E4B53 // "SKNY"
+#define SUPERBLOCK_VERSION 2
 
-#define SECTORS_PER_CHUNK (CHUNK_SIZE / IDE_SECTOR_SIZE)
+// Lives in the first sector of the disk. Format zeroes the rest of
+// chunk 0 along with the other metadata. Everything else on the disk
+// is found through it.
+struct SknySuperblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;   // In bytes
+    uint32_t total_chunks; // How many the allocation map tracks
+    ChunkLocation allocation_map_start;
+    uint32_t allocation_map_chunks;
+    ChunkLocation file_map_start;
+    uint32_t file_map_chunks;
+    ChunkLocation journal_start;
+    uint32_t journal_chunks;
+    ChunkLocation data_start; // Everything before is metadata
+} __attribute__((packed));
 
-#define CHUNKS_IN_ALLOCATION_MAP (16)
-#define CHUNKS_IN_FILE_MAP       (16)
+// A run of chunks holding consecutive parts of a file
+typedef struct {
+    ChunkLocation start;
+    uint32_t length; // In chunks
+} __attribute__((packed)) Extent;
+
+#define EXTENTS_PER_FILE 5
+#define FILE_NAME_SIZE   208
+#define INLINE_DATA_SIZE (IDE_SECTOR_SIZE - FILE_NAME_SIZE - 8)
+
+// Set on files small enough to keep their data in their entry, in
+// place of extents. They have no chunks, and reading one takes no I/O
+// past the entry itself.
+#define FILE_INLINE 0x1
 
+// 512 bytes, one sector, so an entry is read and written on its own
 typedef struct {
     // An empty name '' indicates that this file metadata does not exist
-    uint8_t name[252];
-    ChunkLocation location;
+    uint8_t name[FILE_NAME_SIZE];
+    uint32_t size; // In bytes
+    uint32_t flags;
+    union {
+        struct {
+            uint32_t extent_count;
+            Extent extents[EXTENTS_PER_FILE];
+        } __attribute__((packed));
+        uint8_t inline_data[INLINE_DATA_SIZE];
+    };
 } __attribute__((packed)) FileMetadata;
 
-#define ALLOCATION_MAP_BEGIN (0)
-#define FILE_MAP_BEGIN (CHUNKS_IN_ALLOCATION_MAP * CHUNK_SIZE)
-#define STORAGE_BEGIN ((CHUNKS_IN_ALLOCATION_MAP * CHUNKS_IN_FILE_MAP) * CHUNK_SIZE)
+#define FILES_PER_SECTOR (IDE_SECTOR_SIZE / sizeof(FileMetadata))
+#define BITS_PER_WORD    32
+
+static uint32_t chunkSize(SknyHandle* handle) {
+    return handle->superblock->chunk_size;
+}
+
+static SectorLocation chunkToSector(SknyHandle* handle, ChunkLocation chunk) {
+    return chunk * (chunkSize(handle) / IDE_SECTOR_SIZE);
+}
+
+static uint32_t maximumFileCount(SknyHandle* handle) {
+    return (handle->superblock->file_map_chunks * chunkSize(handle)) / sizeof(FileMetadata);
+}
 
-#define FILES_PER_CHUNK (CHUNK_SIZE / sizeof(FileMetadata))
+// In bytes. Always whole chunks, even if the last one is only partly
+// needed for the bits.
+static uint32_t allocationMapSize(SknyHandle* handle) {
+    return handle->superblock->allocation_map_chunks * chunkSize(handle);
+}
+
+// Must be a power of two
+#define DIRECTORY_BUCKETS 64
+#define NO_FILE           0xFFFFFFFF
 
-#define TOTAL_ALLOCATABLE_CHUNKS \
-(CHUNKS_IN_ALLOCATION_MAP * CHUNK_SIZE * 8)
-#define MAXIMUM_FILE_COUNT \
-(CHUNKS_IN_FILE_MAP * CHUNK_SIZE / sizeof(FileMetadata))
+// In-memory index of the file map, rebuilt at mount, so finding a file
+// by name or a free entry doesn't mean reading the whole file map
+struct SknyDirectory {
+    // Heads of the hash chains
+    FileIndex buckets[DIRECTORY_BUCKETS];
+    // For each file map entry in use: the next entry in its chain, and
+    // the hash of its name, so most mismatches never touch the disk.
+    // These are sized by the file map and live right after the struct.
+    FileIndex* next;
+    uint32_t* hashes;
+    // Stack of empty entries, lowest index on top
+    FileIndex* free_slots;
+    uint32_t free_count;
+};
 
 #define INFORMATION_DUMP true
 
@@ -48,133 +117,492 @@ static const char* sknyStatusStrings[] = {
     "SKNY_STATUS_OK",
     "SKNY_WRITE_FAILURE",
     "SKNY_READ_FAILURE",
-    "SKNY_FILESYSTEM_FULL"
+    "SKNY_FILESYSTEM_FULL",
+    "SKNY_FILE_NOT_FOUND",
+    "SKNY_FILE_TOO_FRAGMENTED",
+    "SKNY_BAD_POSITION",
+    "SKNY_BAD_SUPERBLOCK"
 };
 
 const char* sknyStatusToString(SknyStatus status) {
     return sknyStatusStrings[status];
 }
 
-static SknyStatus searchAllocationMap(SknyHandle* handle, ChunkLocation* ret) {
-    for (uint32_t i = 0; i < CHUNKS_IN_ALLOCATION_MAP; i++) {
-        uint8_t map_chunk[CHUNK_SIZE];
-        AbsoluteLocation read_location = ALLOCATION_MAP_BEGIN + (i * CHUNK_SIZE);
-        ATAError err = ideReadSectors(handle->drive, SECTORS_PER_CHUNK, read_location, map_chunk);
-        if (err != NoError) {
-            idePrintError(handle->drive, err);
-            return SKNY_READ_FAILURE;
+//
+// Metadata journal
+//
+// Changes to the allocation map and the file map don't go to their
+// home sectors straight away. They collect in a running transaction
+// in memory, and many operations' changes are committed together as
+// one sequential write to the journal region: a header listing the
+// home sectors, their new contents, then a commit record with a
+// checksum over the lot. Only once that is on the disk are the
+// sectors written home, through the write-back cache, so they reach
+// the disk whenever the cache gets to them. The next commit syncs
+// them before it overwrites the journal. A crash at any point leaves
+// either the old metadata or a complete journal to replay at mount.
+//
+
+#define JOURNAL_MAGIC        0x4A4E4B53 // "SKNJ"
+#define JOURNAL_COMMIT_MAGIC 0x434E4B53 // "SKNC"
+// What fits in the header's list of home sectors
+#define JOURNAL_MAX_ENTRIES  ((IDE_SECTOR_SIZE / 4) - 3)
+// A full transaction: header, contents and commit record. The journal
+// region is this, rounded up to whole chunks.
+#define JOURNAL_SECTORS      (JOURNAL_MAX_ENTRIES + 2)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;
+    SectorLocation sectors[JOURNAL_MAX_ENTRIES];
+} __attribute__((packed)) JournalHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t checksum;
+    uint8_t padding[IDE_SECTOR_SIZE - 12];
+} __attribute__((packed)) JournalCommit;
+
+struct SknyJournal {
+    uint32_t sequence;
+    // The running transaction. The header doubles as the list of which
+    // home sectors are in it.
+    JournalHeader header;
+    uint8_t data[JOURNAL_MAX_ENTRIES][IDE_SECTOR_SIZE];
+    uint32_t commits;
+    uint32_t operations; // Since the last commit
+};
+
+// FNV-1a over the header and data, so a torn journal write is caught
+static uint32_t journalChecksum(const JournalHeader* header, const uint8_t* data) {
+    uint32_t hash = 2166136261u;
+    const uint8_t* bytes = (const uint8_t*) header;
+    for (uint32_t i = 0; i < sizeof(JournalHeader); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (uint32_t i = 0; i < header->count * IDE_SECTOR_SIZE; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static SknyJournal* journalCreate(uint32_t sequence) {
+    SknyJournal* journal = kheapAlloc(sizeof(SknyJournal));
+    kmemset(&journal->header, 0, sizeof(JournalHeader));
+    journal->sequence = sequence;
+    journal->header.magic = JOURNAL_MAGIC;
+    journal->header.count = 0;
+    journal->commits = 0;
+    journal->operations = 0;
+    return journal;
+}
+
+static int32_t journalFind(SknyJournal* journal, SectorLocation sector) {
+    for (uint32_t i = 0; i < journal->header.count; i++) {
+        if (journal->header.sectors[i] == sector) {
+            return i;
         }
-        for (uint32_t j = 0; j < CHUNK_SIZE; j++) {
-            uint8_t byte_field = map_chunk[j];
-            if (byte_field != 0xff) {
-                // Found a chunk!
-                for (uint8_t bit = 0; bit < 8; bit++) {
-                    if ((byte_field & (1 << bit)) == 0) {
-                        ChunkLocation location = 0;
-                        location += i * (CHUNK_SIZE * 8); // Offset by bits per allocation map chunk
-                        location += j * 8;                // Ofset by bits per byte in allocation chunk
-                        location += bit;                  // Offset by bit in this byte
-                        *ret = location;
-                        return SKNY_STATUS_OK;
-                    }
-                }
-            }
+    }
+    return -1;
+}
+
+static SknyStatus journalCommit(SknyHandle* handle) {
+    SknyJournal* journal = handle->journal;
+    if (journal->header.count == 0) {
+        return SKNY_STATUS_OK;
+    }
+    
+    // The last transaction's home writes have to be on the disk before
+    // its copy in the journal is overwritten
+    if (!bcacheSync()) {
+        return SKNY_WRITE_FAILURE;
+    }
+    
+    // Header, data and commit record go out as one sequential write
+    journal->header.sequence = journal->sequence;
+    uint32_t count = journal->header.count;
+    SectorLocation journal_sector = chunkToSector(handle, handle->superblock->journal_start);
+    JournalCommit commit;
+    kmemset(&commit, 0, sizeof(JournalCommit));
+    commit.magic = JOURNAL_COMMIT_MAGIC;
+    commit.sequence = journal->sequence;
+    commit.checksum = journalChecksum(&journal->header, (const uint8_t*) journal->data);
+    if (!bcacheWrite(handle->drive, journal_sector, 1, &journal->header)
+        || !bcacheWrite(handle->drive, journal_sector + 1, count, journal->data)
+        || !bcacheWrite(handle->drive, journal_sector + 1 + count, 1, &commit)
+        || !bcacheSync()) {
+        return SKNY_WRITE_FAILURE;
+    }
+    
+    // Checkpoint: home writes sit in the cache until it's convenient
+    for (uint32_t i = 0; i < count; i++) {
+        if (!bcacheWrite(handle->drive, journal->header.sectors[i], 1, journal->data[i])) {
+            return SKNY_WRITE_FAILURE;
         }
     }
-    return SKNY_FILESYSTEM_FULL;
-}
-
-// TODO(Brooke): If this function reads in only the sector containing
-// the bit, and not the entire chunk containing the bit, it will
-// become way, way, way more efficient. So do that.
-static SknyStatus markChunkAsUsed(SknyHandle* handle, ChunkLocation chunk_number) {
-    const uint32_t BITS_PER_CHUNK        = CHUNK_SIZE * 8;
-    uint32_t       map_chunk             = chunk_number / BITS_PER_CHUNK;
-    uint32_t       offset_into_map_chunk = chunk_number % BITS_PER_CHUNK;
-    uint32_t       byte_offset           = offset_into_map_chunk / 8;
-    uint8_t        bit_offset            = offset_into_map_chunk % 8;
-    // Read in chunk
-    uint8_t map_chunk_buffer[CHUNK_SIZE];
-    /*
-    for (int i = 0; i < CHUNK_SIZE; i++) {
-        kprintf("%x,", map_chunk_buffer[i]);
-    }
-    kprintf("\n");*/
-    AbsoluteLocation map_chunk_location = ALLOCATION_MAP_BEGIN + (map_chunk * CHUNK_SIZE);
-    ATAError err = ideReadSectors(handle->drive, SECTORS_PER_CHUNK, map_chunk_location, map_chunk_buffer);
-    if (err != NoError) {
-        idePrintError(handle->drive, err);
+    
+    journal->header.count = 0;
+    // The frees are on the disk now, so the chunks can be reused
+    kmemcpy(handle->committed_map, handle->allocation_map, allocationMapSize(handle));
+    journal->sequence++;
+    journal->commits++;
+    journal->operations = 0;
+    return SKNY_STATUS_OK;
+}
+
+// Most sectors resizing a file by `chunks` chunks can change: each
+// extent touched can straddle two sectors of the allocation map, and
+// the file's entry in the file map
+#define RESIZE_SECTORS(chunks) (((chunks) / (IDE_SECTOR_SIZE * 8)) + (2 * EXTENTS_PER_FILE) + 1)
+
+// Makes sure the running transaction has room for an operation that
+// changes up to `sectors` sectors, so none of it ends up split across
+// two commits
+static SknyStatus journalReserve(SknyHandle* handle, uint32_t sectors) {
+    SknyJournal* journal = handle->journal;
+    journal->operations++;
+    if (journal->header.count + sectors > JOURNAL_MAX_ENTRIES) {
+        return journalCommit(handle);
+    }
+    return SKNY_STATUS_OK;
+}
+
+// Reads a metadata sector, as changed by the running transaction
+static SknyStatus metadataRead(SknyHandle* handle, SectorLocation sector, void* buffer) {
+    int32_t entry = journalFind(handle->journal, sector);
+    if (entry >= 0) {
+        kmemcpy(buffer, handle->journal->data[entry], IDE_SECTOR_SIZE);
+        return SKNY_STATUS_OK;
+    }
+    if (!bcacheRead(handle->drive, sector, 1, buffer)) {
         return SKNY_READ_FAILURE;
     }
-    // Set the bit
-    map_chunk_buffer[byte_offset] |= (1 << bit_offset);
-    // Write the chunk back
-    err = ideWriteSectors(handle->drive, SECTORS_PER_CHUNK, map_chunk_location, map_chunk_buffer);
-    if (err != NoError) {
-        idePrintError(handle->drive, err);
-        return SKNY_WRITE_FAILURE;
+    return SKNY_STATUS_OK;
+}
+
+// Adds a metadata sector to the running transaction
+static SknyStatus metadataWrite(SknyHandle* handle, SectorLocation sector, const void* buffer) {
+    SknyJournal* journal = handle->journal;
+    int32_t entry = journalFind(journal, sector);
+    if (entry < 0) {
+        if (journal->header.count == JOURNAL_MAX_ENTRIES) {
+            // Only happens if an operation reserved too little
+            SknyStatus status = journalCommit(handle);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+        }
+        entry = journal->header.count++;
+        journal->header.sectors[entry] = sector;
     }
+    kmemcpy(journal->data[entry], buffer, IDE_SECTOR_SIZE);
     return SKNY_STATUS_OK;
 }
 
-static SknyStatus searchFileMap(SknyHandle* handle, FileIndex* ret) {
-    for (ChunkLocation chunk_index = 0; chunk_index < CHUNKS_IN_FILE_MAP; chunk_index++) {
-        FileMetadata files[FILES_PER_CHUNK];
-        AbsoluteLocation location = FILE_MAP_BEGIN + (chunk_index * CHUNK_SIZE);
-        ATAError err = ideReadSectors(handle->drive, SECTORS_PER_CHUNK, location, (uint8_t*) files);
-        if (err != NoError) {
-            idePrintError(handle->drive, err);
-            return SKNY_READ_FAILURE;
+// Puts back the last committed transaction, if there's a complete one.
+// Doing it again for one that was already checkpointed is harmless.
+// Returns the sequence number the next transaction should use.
+static SknyStatus journalReplay(SknyHandle* handle, uint32_t* next_sequence) {
+    *next_sequence = 1;
+    uint8_t drive = handle->drive;
+    SectorLocation journal_sector = chunkToSector(handle, handle->superblock->journal_start);
+    JournalHeader* header = kheapAlloc(sizeof(JournalHeader));
+    if (!bcacheRead(drive, journal_sector, 1, header)) {
+        kheapFree(header);
+        return SKNY_READ_FAILURE;
+    }
+    if (header->magic != JOURNAL_MAGIC || header->count == 0 || header->count > JOURNAL_MAX_ENTRIES) {
+        kheapFree(header);
+        return SKNY_STATUS_OK;
+    }
+    
+    uint32_t count = header->count;
+    uint8_t* data = kheapAlloc(count * IDE_SECTOR_SIZE);
+    JournalCommit commit;
+    SknyStatus status = SKNY_STATUS_OK;
+    if (!bcacheRead(drive, journal_sector + 1, count, data)
+        || !bcacheRead(drive, journal_sector + 1 + count, 1, &commit)) {
+        status = SKNY_READ_FAILURE;
+    } else if (commit.magic == JOURNAL_COMMIT_MAGIC
+               && commit.sequence == header->sequence
+               && commit.checksum == journalChecksum(header, data)) {
+#if INFORMATION_DUMP
+        kprintf("Replaying SknyFS journal (transaction %u, %u sectors)\n", header->sequence, count);
+#endif
+        for (uint32_t i = 0; i < count; i++) {
+            if (!bcacheWrite(drive, header->sectors[i], 1, data + (i * IDE_SECTOR_SIZE))) {
+                status = SKNY_WRITE_FAILURE;
+            }
+        }
+        if (status == SKNY_STATUS_OK && !bcacheSync()) {
+            status = SKNY_WRITE_FAILURE;
         }
-        for (uint32_t file_index = 0; file_index < FILES_PER_CHUNK; file_index++) {
-            FileMetadata file = files[file_index];
-            kprintf("file %u: name (%s) location (%u)\n", (chunk_index * FILES_PER_CHUNK) + file_index, file.name, file.location);
-            if (file.name[0] == '\0') {
-                // We've found an empty spot!
-                *ret = (chunk_index * FILES_PER_CHUNK) + file_index;
+        *next_sequence = header->sequence + 1;
+    }
+    kheapFree(data);
+    kheapFree(header);
+    return status;
+}
+
+// Bits set for chunks that can't be handed out: used ones, and ones
+// freed since the last commit. Chunks taken and given back within the
+// running transaction never left the disk's free list, so they're fine.
+static uint32_t unavailableChunks(SknyHandle* handle, uint32_t word) {
+    return handle->allocation_map[word] | handle->committed_map[word];
+}
+
+static bool isChunkAvailable(SknyHandle* handle, ChunkLocation chunk) {
+    return (unavailableChunks(handle, chunk / BITS_PER_WORD) & (1u << (chunk % BITS_PER_WORD))) == 0;
+}
+
+// Next fit: carries on from the last chunk handed out and wraps around
+// to the start once, skipping full words of the map. Returns the first
+// free run of `wanted` chunks, or failing that the longest free run
+// there is.
+static SknyStatus searchAllocationMap(SknyHandle* handle, uint32_t wanted, Extent* ret) {
+    Extent best = { 0, 0 };
+    Extent run = { 0, 0 };
+    uint32_t total_chunks = handle->superblock->total_chunks;
+    ChunkLocation chunk = handle->next_fit % total_chunks;
+    uint32_t scanned = 0;
+    while (scanned < total_chunks) {
+        if (chunk == total_chunks) {
+            // Runs can't wrap around the end of the disk
+            chunk = 0;
+            run.length = 0;
+        }
+        if (chunk % BITS_PER_WORD == 0 && unavailableChunks(handle, chunk / BITS_PER_WORD) == 0xFFFFFFFF) {
+            run.length = 0;
+            chunk += BITS_PER_WORD;
+            scanned += BITS_PER_WORD;
+            continue;
+        }
+        if (!isChunkAvailable(handle, chunk)) {
+            run.length = 0;
+        } else {
+            if (run.length == 0) {
+                run.start = chunk;
+            }
+            run.length++;
+            if (run.length > best.length) {
+                best = run;
+            }
+            if (run.length == wanted) {
+                *ret = run;
                 return SKNY_STATUS_OK;
             }
         }
+        chunk++;
+        scanned++;
+    }
+    if (best.length == 0) {
+        return SKNY_FILESYSTEM_FULL;
     }
-    return SKNY_FILESYSTEM_FULL;
+    *ret = best;
+    return SKNY_STATUS_OK;
 }
 
-// TODO(Brooke): If this function reads in only the sector containing
-// the metadata, and not the entire chunk containing the metadata, it
-// will become a bit more efficient. So do that.
-static writeFileMetadata(SknyHandle* handle, FileIndex file_index, FileMetadata* file_metadata) { 
-    ChunkLocation chunk_offset = file_index / FILES_PER_CHUNK;
-    AbsoluteLocation location = FILE_MAP_BEGIN + (chunk_offset * CHUNK_SIZE);
-    FileMetadata files[FILES_PER_CHUNK];
-    ATAError err = ideReadSectors(handle->drive, SECTORS_PER_CHUNK, location, (uint8_t*) files);
-    if (err != NoError) {
-        idePrintError(handle->drive, err);
-        return SKNY_READ_FAILURE;
+// Sets or clears the bits in memory and writes back just the sectors
+// of the map they're in
+static SknyStatus markChunks(SknyHandle* handle, Extent extent, bool used) {
+    for (uint32_t i = 0; i < extent.length; i++) {
+        ChunkLocation chunk = extent.start + i;
+        uint32_t bit = 1u << (chunk % BITS_PER_WORD);
+        if (used) {
+            handle->allocation_map[chunk / BITS_PER_WORD] |= bit;
+        } else {
+            handle->allocation_map[chunk / BITS_PER_WORD] &= ~bit;
+        }
     }
-    files[file_index % FILES_PER_CHUNK] = *file_metadata;
-    err = ideWriteSectors(handle->drive, SECTORS_PER_CHUNK, location, (uint8_t*) files);
-    if (err != NoError) {
-        idePrintError(handle->drive, err);
-        return SKNY_WRITE_FAILURE;
+    
+    uint32_t first_sector = (extent.start / 8) / IDE_SECTOR_SIZE;
+    uint32_t last_sector = ((extent.start + extent.length - 1) / 8) / IDE_SECTOR_SIZE;
+    const uint8_t* map_bytes = (const uint8_t*) handle->allocation_map;
+    for (uint32_t map_sector = first_sector; map_sector <= last_sector; map_sector++) {
+        SectorLocation sector = chunkToSector(handle, handle->superblock->allocation_map_start) + map_sector;
+        SknyStatus status = metadataWrite(handle, sector, map_bytes + (map_sector * IDE_SECTOR_SIZE));
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
     }
     return SKNY_STATUS_OK;
 }
 
+static uint32_t fileChunkCount(FileMetadata* file) {
+    if (file->flags & FILE_INLINE) {
+        return 0;
+    }
+    uint32_t chunks = 0;
+    for (uint32_t i = 0; i < file->extent_count; i++) {
+        chunks += file->extents[i].length;
+    }
+    return chunks;
+}
+
+// Gives back everything past the file's first `keep` chunks
+static SknyStatus shrinkFile(SknyHandle* handle, FileMetadata* file, uint32_t keep) {
+    uint32_t chunks = fileChunkCount(file);
+    while (chunks > keep) {
+        Extent* last = &file->extents[file->extent_count - 1];
+        uint32_t excess = chunks - keep;
+        uint32_t freed = (excess < last->length) ? excess : last->length;
+        Extent tail = { last->start + last->length - freed, freed };
+        SknyStatus status = markChunks(handle, tail, false);
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+        last->length -= freed;
+        if (last->length == 0) {
+            file->extent_count--;
+        }
+        chunks -= freed;
+    }
+    return SKNY_STATUS_OK;
+}
+
+// Gives the file `count` more chunks, as few extents as possible. The
+// search starts right after the file's last extent, so a growing file
+// gets to extend it in place when the chunks there are free. If it
+// can't have all of them, whatever this call already took goes back,
+// so no chunks are left marked as used with no file owning them.
+static SknyStatus growFile(SknyHandle* handle, FileMetadata* file, uint32_t count) {
+    uint32_t had = fileChunkCount(file);
+    SknyStatus status = SKNY_STATUS_OK;
+    while (count > 0) {
+        Extent* last = (file->extent_count == 0) ? NULL : &file->extents[file->extent_count - 1];
+        if (last != NULL) {
+            handle->next_fit = last->start + last->length;
+        }
+        Extent run;
+        status = searchAllocationMap(handle, count, &run);
+        if (status != SKNY_STATUS_OK) {
+            break;
+        }
+        bool extends_last = (last != NULL && last->start + last->length == run.start);
+        if (!extends_last && file->extent_count == EXTENTS_PER_FILE) {
+            status = SKNY_FILE_TOO_FRAGMENTED;
+            break;
+        }
+        status = markChunks(handle, run, true);
+        if (status != SKNY_STATUS_OK) {
+            // Not part of the file yet, so shrinkFile won't free it
+            markChunks(handle, run, false);
+            break;
+        }
+        if (extends_last) {
+            last->length += run.length;
+        } else {
+            file->extents[file->extent_count++] = run;
+        }
+        handle->next_fit = run.start + run.length;
+        count -= run.length;
+    }
+    if (status != SKNY_STATUS_OK) {
+        shrinkFile(handle, file, had);
+    }
+    return status;
+}
+
+// Undoes a shrinkFile whose entry never got written, taking back the
+// chunks `before` had, so its entry on the disk isn't left pointing at
+// chunks that are free
+static void unshrinkFile(SknyHandle* handle, FileMetadata* file, const FileMetadata* before) {
+    for (uint32_t i = 0; i < before->extent_count; i++) {
+        markChunks(handle, before->extents[i], true);
+    }
+    *file = *before;
+}
+
+// FNV-1a
+static uint32_t hashName(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (uint8_t) *name;
+        hash *= 16777619u;
+        name++;
+    }
+    return hash;
+}
+
+static void directoryInsert(SknyDirectory* directory, FileIndex file_index, uint32_t hash) {
+    uint32_t bucket = hash & (DIRECTORY_BUCKETS - 1);
+    directory->hashes[file_index] = hash;
+    directory->next[file_index] = directory->buckets[bucket];
+    directory->buckets[bucket] = file_index;
+}
+
+// Builds the index from a copy of the whole file map
+static SknyDirectory* directoryBuild(const FileMetadata* files, uint32_t file_count) {
+    // One allocation, so it's let go of with one kheapFree
+    SknyDirectory* directory = kheapAlloc(sizeof(SknyDirectory) + (3 * file_count * sizeof(uint32_t)));
+    directory->next = (FileIndex*) (directory + 1);
+    directory->hashes = directory->next + file_count;
+    directory->free_slots = directory->hashes + file_count;
+    for (uint32_t i = 0; i < DIRECTORY_BUCKETS; i++) {
+        directory->buckets[i] = NO_FILE;
+    }
+    directory->free_count = 0;
+    // Walk backwards so the lowest free entry ends up on top
+    for (FileIndex i = file_count; i-- > 0;) {
+        if (files[i].name[0] == '\0') {
+            directory->free_slots[directory->free_count++] = i;
+        } else {
+            directoryInsert(directory, i, hashName((const char*) files[i].name));
+        }
+    }
+    return directory;
+}
+
+static SknyStatus searchFileMap(SknyHandle* handle, FileIndex* ret) {
+    SknyDirectory* directory = handle->directory;
+    if (directory->free_count == 0) {
+        return SKNY_FILESYSTEM_FULL;
+    }
+    // We've found an empty spot! It stays on the free list until the
+    // file has actually been written to it.
+    *ret = directory->free_slots[directory->free_count - 1];
+    return SKNY_STATUS_OK;
+}
+
+static SectorLocation fileMetadataSector(SknyHandle* handle, FileIndex file_index) {
+    return chunkToSector(handle, handle->superblock->file_map_start) + (file_index / FILES_PER_SECTOR);
+}
+
+// Reads in only the sector holding the entry
+static SknyStatus readFileMetadata(SknyHandle* handle, FileIndex file_index, FileMetadata* file_metadata) {
+    FileMetadata files[FILES_PER_SECTOR];
+    SectorLocation sector = fileMetadataSector(handle, file_index);
+    SknyStatus status = metadataRead(handle, sector, files);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    *file_metadata = files[file_index % FILES_PER_SECTOR];
+    return SKNY_STATUS_OK;
+}
+
+static SknyStatus writeFileMetadata(SknyHandle* handle, FileIndex file_index, FileMetadata* file_metadata) { 
+    FileMetadata files[FILES_PER_SECTOR];
+    SectorLocation sector = fileMetadataSector(handle, file_index);
+    SknyStatus status = metadataRead(handle, sector, files);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    files[file_index % FILES_PER_SECTOR] = *file_metadata;
+    return metadataWrite(handle, sector, files);
+}
+
 SknyStatus sknyCreateFile(SknyHandle* handle, const char* name) {
     //
     // First, can we fit the file?
     //
-    ChunkLocation available_chunk;
-    SknyStatus status = searchAllocationMap(handle, &available_chunk);
+    FileIndex file_index;
+    SknyStatus status = searchFileMap(handle, &file_index);
     if (status != SKNY_STATUS_OK) {
         return status;
     }
-#if INFORMATION_DUMP
-    kprintf("ALLOCATING FILE TO CHUNK %u\n", available_chunk);
-#endif
-    
-    FileIndex file_index;
-    status = searchFileMap(handle, &file_index);
+    status = journalReserve(handle, 1);
     if (status != SKNY_STATUS_OK) {
         return status;
     }
@@ -184,40 +612,117 @@ SknyStatus sknyCreateFile(SknyHandle* handle, const char* name) {
 #endif
     
     //
-    // Now, actually create the file
+    // Now, actually create the file. It starts out empty and inline, so
+    // it doesn't get any chunks until it outgrows its entry.
     //
-    markChunkAsUsed(handle, available_chunk);
-    
     FileMetadata file_metadata;
-    kmemset(file_metadata.name, 0, 252);
-    kstrncpy(file_metadata.name, name, 252);
-    file_metadata.location = available_chunk;
-    writeFileMetadata(handle, file_index, &file_metadata);
+    kmemset(&file_metadata, 0, sizeof(FileMetadata));
+    kstrncpy((char*) file_metadata.name, name, FILE_NAME_SIZE - 1);
+    file_metadata.flags = FILE_INLINE;
+    
+    status = writeFileMetadata(handle, file_index, &file_metadata);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    handle->directory->free_count--;
+    directoryInsert(handle->directory, file_index, hashName((const char*) file_metadata.name));
     
     return SKNY_STATUS_OK;
 }
 
+// Only entries whose name hashes the same get read from the disk
 static SknyStatus searchForFile(SknyHandle* handle, const char* name, FileIndex* ret) {
-    for (ChunkLocation chunk_index = 0; chunk_index < CHUNKS_IN_FILE_MAP; chunk_index++) {
-        FileMetadata files[FILES_PER_CHUNK];
-        AbsoluteLocation location = FILE_MAP_BEGIN + (chunk_index * CHUNK_SIZE);
-        ATAError err = ideReadSectors(handle->drive, SECTORS_PER_CHUNK, location, (uint8_t*) files);
-        if (err != NoError) {
-            idePrintError(handle->drive, err);
+    uint32_t hash = hashName(name);
+    SknyDirectory* directory = handle->directory;
+    FileIndex file_index = directory->buckets[hash & (DIRECTORY_BUCKETS - 1)];
+    while (file_index != NO_FILE) {
+        if (directory->hashes[file_index] == hash) {
+            FileMetadata file;
+            SknyStatus status = readFileMetadata(handle, file_index, &file);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+            if (kstrcmp(name, (const char*) file.name) == 0) {
+                *ret = file_index;
+                return SKNY_STATUS_OK;
+            }
+        }
+        file_index = directory->next[file_index];
+    }
+    return SKNY_FILE_NOT_FOUND;
+}
+
+// The block queue takes a copy of every write, so big ones are handed
+// to it in pieces this size. It still merges them back into long
+// commands.
+#define DIRECT_WRITE_SECTORS 128
+
+// File data goes around the buffer cache, straight between the
+// caller's buffer and the block layer. A run of chunks then reaches the
+// drive as one command, and one big file can't push all the metadata
+// out of the cache. Cached copies of the sectors are written back
+// before a read, and dropped before a write replaces them.
+static SknyStatus transferSectors(SknyHandle* handle, SectorLocation sector, uint32_t count, uint8_t* buffer, bool write) {
+    if (!write) {
+        if (!bcacheEvict(handle->drive, sector, count)
+            || !blockRead(handle->drive, (char*) buffer, sector, count)) {
             return SKNY_READ_FAILURE;
         }
-        for (uint32_t file_index = 0; file_index < FILES_PER_CHUNK; file_index++) {
-            FileMetadata file = files[file_index];
-            if (kstrcmp(name, file.name) == 0) {
-                *ret = (chunk_index * FILES_PER_CHUNK) + file_index;
-                return SKNY_STATUS_OK;
+        return SKNY_STATUS_OK;
+    }
+    bcacheInvalidate(handle->drive, sector, count);
+    while (count > 0) {
+        uint32_t piece = (count > DIRECT_WRITE_SECTORS) ? DIRECT_WRITE_SECTORS : count;
+        if (!blockWrite(handle->drive, (const char*) buffer, sector, piece)) {
+            return SKNY_WRITE_FAILURE;
+        }
+        buffer += piece * IDE_SECTOR_SIZE;
+        sector += piece;
+        count -= piece;
+    }
+    return SKNY_STATUS_OK;
+}
+
+// Moves the first `size` bytes of a file's data to or from `buffer`,
+// one multi-sector transfer per extent. Only the last sector can be
+// partial, and it goes through a bounce buffer.
+static SknyStatus transferFileData(SknyHandle* handle, FileMetadata* file, uint8_t* buffer, uint32_t size, bool write) {
+    for (uint32_t i = 0; i < file->extent_count && size > 0; i++) {
+        Extent extent = file->extents[i];
+        uint32_t extent_bytes = extent.length * chunkSize(handle);
+        uint32_t bytes = (size < extent_bytes) ? size : extent_bytes;
+        SectorLocation sector = chunkToSector(handle, extent.start);
+        uint32_t whole_sectors = bytes / IDE_SECTOR_SIZE;
+        uint32_t leftover = bytes % IDE_SECTOR_SIZE;
+        
+        if (whole_sectors > 0) {
+            SknyStatus status = transferSectors(handle, sector, whole_sectors, buffer, write);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+        }
+        if (leftover > 0) {
+            uint8_t partial[IDE_SECTOR_SIZE];
+            uint8_t* tail = buffer + (whole_sectors * IDE_SECTOR_SIZE);
+            if (write) {
+                kmemset(partial, 0, IDE_SECTOR_SIZE);
+                kmemcpy(partial, tail, leftover);
+            }
+            SknyStatus status = transferSectors(handle, sector + whole_sectors, 1, partial, write);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+            if (!write) {
+                kmemcpy(tail, partial, leftover);
             }
         }
+        buffer += bytes;
+        size -= bytes;
     }
-    return SKNY_FILESYSTEM_FULL;
+    return SKNY_STATUS_OK;
 }
 
-SknyStatus sknyWriteFile(SknyHandle* handle, const char* name) {
+SknyStatus sknyWriteFile(SknyHandle* handle, const char* name, const void* data, uint32_t size) {
     //
     // Does the file exist?
     //
@@ -226,68 +731,653 @@ SknyStatus sknyWriteFile(SknyHandle* handle, const char* name) {
     if (status != SKNY_STATUS_OK) {
         return status;
     }
+    FileMetadata file;
+    status = readFileMetadata(handle, file_index, &file);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    
+    //
+    // Small enough to keep in the entry? Any chunks it had go back.
+    //
+    uint32_t have = fileChunkCount(&file);
+    FileMetadata before = file;
+    if (size <= INLINE_DATA_SIZE) {
+        status = journalReserve(handle, RESIZE_SECTORS(have));
+        if (status == SKNY_STATUS_OK) {
+            status = shrinkFile(handle, &file, 0);
+        }
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+        file.flags |= FILE_INLINE;
+        kmemset(file.inline_data, 0, INLINE_DATA_SIZE);
+        kmemcpy(file.inline_data, data, size);
+        file.size = size;
+        status = writeFileMetadata(handle, file_index, &file);
+        if (status != SKNY_STATUS_OK) {
+            unshrinkFile(handle, &file, &before);
+        }
+        return status;
+    }
+    if (file.flags & FILE_INLINE) {
+        // No extents yet, and the old contents go with the inline data
+        kmemset(file.inline_data, 0, INLINE_DATA_SIZE);
+        file.flags &= ~FILE_INLINE;
+        file.size = 0;
+    }
+    
+    //
+    // Make it the right size. The resized entry goes into the same
+    // transaction as the chunks it gains or loses, before any data is
+    // written, so a failure from here on can't leave chunks used with
+    // no owner, or free with an owner.
+    //
+    uint32_t needed = (size + chunkSize(handle) - 1) / chunkSize(handle);
+    status = journalReserve(handle, RESIZE_SECTORS((needed > have) ? needed - have : have - needed));
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    status = (needed > have)
+        ? growFile(handle, &file, needed - have)
+        : shrinkFile(handle, &file, needed);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    if (file.size > needed * chunkSize(handle)) {
+        file.size = needed * chunkSize(handle);
+    }
+    status = writeFileMetadata(handle, file_index, &file);
+    if (status != SKNY_STATUS_OK) {
+        if (needed > have) {
+            shrinkFile(handle, &file, have);
+        } else {
+            unshrinkFile(handle, &file, &before);
+        }
+        return status;
+    }
     
     //
     // Write to the file
     //
+    status = transferFileData(handle, &file, (uint8_t*) data, size, true);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    file.size = size;
+    return writeFileMetadata(handle, file_index, &file);
+}
+
+SknyStatus sknyReadFile(SknyHandle* handle, const char* name, void* buffer, uint32_t buffer_size, uint32_t* size_read) {
+    FileIndex file_index;
+    SknyStatus status = searchForFile(handle, name, &file_index);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    FileMetadata file;
+    status = readFileMetadata(handle, file_index, &file);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    uint32_t size = (file.size < buffer_size) ? file.size : buffer_size;
+    if (file.flags & FILE_INLINE) {
+        kmemcpy(buffer, file.inline_data, size);
+    } else {
+        status = transferFileData(handle, &file, (uint8_t*) buffer, size, false);
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+    }
+    *size_read = size;
+    return SKNY_STATUS_OK;
+}
+
+//
+// Streaming access
+//
+
+struct SknyFile {
+    SknyHandle* handle;
+    FileIndex file_index;
+    FileMetadata metadata;
+    bool metadata_dirty;
+    uint32_t position;
+    uint32_t staged_chunk; // Chunk of the file, NO_CHUNK if none
+    bool staging_dirty;
+    // One chunk of the file, so small reads and writes don't each go to
+    // the cache, and a run of small sequential writes leaves as one
+    // whole-chunk write
+    uint8_t staging[];
+};
+
+#define NO_CHUNK 0xFFFFFFFF
+
+// Moves `count` whole chunks of the file, starting at its chunk
+// `first`, with one transfer per extent they fall in
+static SknyStatus transferChunks(SknyHandle* handle, FileMetadata* file, uint32_t first, uint32_t count, uint8_t* buffer, bool write) {
+    uint32_t extent_first = 0;
+    for (uint32_t i = 0; i < file->extent_count && count > 0; i++) {
+        Extent extent = file->extents[i];
+        if (first >= extent_first + extent.length) {
+            extent_first += extent.length;
+            continue;
+        }
+        uint32_t offset = first - extent_first;
+        uint32_t chunks = extent.length - offset;
+        if (chunks > count) {
+            chunks = count;
+        }
+        SknyStatus status = transferSectors(handle, chunkToSector(handle, extent.start + offset),
+                                            chunkToSector(handle, chunks), buffer, write);
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+        buffer += chunks * chunkSize(handle);
+        first += chunks;
+        count -= chunks;
+        extent_first += extent.length;
+    }
+    if (count > 0) {
+        // Some of them aren't allocated to the file
+        return write ? SKNY_WRITE_FAILURE : SKNY_READ_FAILURE;
+    }
+    return SKNY_STATUS_OK;
+}
+
+static SknyStatus flushStaging(SknyFile* file) {
+    if (!file->staging_dirty) {
+        return SKNY_STATUS_OK;
+    }
+    SknyStatus status = transferChunks(file->handle, &file->metadata, file->staged_chunk, 1, file->staging, true);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    file->staging_dirty = false;
+    return SKNY_STATUS_OK;
 }
 
-// Very slow!!
-static ATAError clearChunk(SknyHandle* handle, ChunkLocation chunk, uint8_t byte) {
-    uint8_t buffer[IDE_SECTOR_SIZE];
-    // TODO(Brooke): get memset from alex!!
-    for (uint32_t i = 0; i < IDE_SECTOR_SIZE; i++) {
-        buffer[i] = byte;
+// Brings a chunk of the file into the staging buffer. Chunks entirely
+// past the end of the file have nothing worth reading, so they start
+// out zeroed instead.
+static SknyStatus stageChunk(SknyFile* file, uint32_t chunk) {
+    if (file->staged_chunk == chunk) {
+        return SKNY_STATUS_OK;
+    }
+    SknyStatus status = flushStaging(file);
+    if (status != SKNY_STATUS_OK) {
+        return status;
     }
-    for (uint32_t i = 0; i < SECTORS_PER_CHUNK; i++) {
-        ATAError err = ideWriteSectors(
-                                       handle->drive, 1,
-                                       (chunk * CHUNK_SIZE) + (i * IDE_SECTOR_SIZE),
-                                       buffer
-                                       );
-        if (err != NoError) {
-            return err;
+    file->staged_chunk = NO_CHUNK;
+    uint32_t chunk_size = chunkSize(file->handle);
+    if (chunk * chunk_size >= file->metadata.size) {
+        kmemset(file->staging, 0, chunk_size);
+    } else {
+        status = transferChunks(file->handle, &file->metadata, chunk, 1, file->staging, false);
+        if (status != SKNY_STATUS_OK) {
+            return status;
         }
     }
-    return 0;
+    file->staged_chunk = chunk;
+    return SKNY_STATUS_OK;
+}
+
+SknyStatus sknyOpen(SknyHandle* handle, const char* name, SknyFile** ret) {
+    FileIndex file_index;
+    SknyStatus status = searchForFile(handle, name, &file_index);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    SknyFile* file = kheapAlloc(sizeof(SknyFile) + chunkSize(handle));
+    status = readFileMetadata(handle, file_index, &file->metadata);
+    if (status != SKNY_STATUS_OK) {
+        kheapFree(file);
+        return status;
+    }
+    file->handle = handle;
+    file->file_index = file_index;
+    file->metadata_dirty = false;
+    file->position = 0;
+    file->staged_chunk = NO_CHUNK;
+    file->staging_dirty = false;
+    *ret = file;
+    return SKNY_STATUS_OK;
+}
+
+SknyStatus sknyRead(SknyFile* file, void* buffer, uint32_t count, uint32_t* count_read) {
+    uint8_t* iter = (uint8_t*) buffer;
+    uint32_t chunk_size = chunkSize(file->handle);
+    uint32_t size = file->metadata.size;
+    if (file->position + count > size) {
+        count = size - file->position;
+    }
+    *count_read = 0;
+    if (file->metadata.flags & FILE_INLINE) {
+        kmemcpy(iter, file->metadata.inline_data + file->position, count);
+        file->position += count;
+        *count_read = count;
+        return SKNY_STATUS_OK;
+    }
+    while (count > 0) {
+        uint32_t chunk = file->position / chunk_size;
+        uint32_t offset = file->position % chunk_size;
+        SknyStatus status;
+        if (offset == 0 && count >= chunk_size && chunk != file->staged_chunk) {
+            // Whole chunks go straight to the caller. Stop short of the
+            // staged chunk, which may be newer than the disk.
+            uint32_t chunks = count / chunk_size;
+            if (file->staged_chunk != NO_CHUNK && file->staged_chunk > chunk && file->staged_chunk < chunk + chunks) {
+                chunks = file->staged_chunk - chunk;
+            }
+            status = transferChunks(file->handle, &file->metadata, chunk, chunks, iter, false);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+            uint32_t bytes = chunks * chunk_size;
+            iter += bytes;
+            file->position += bytes;
+            *count_read += bytes;
+            count -= bytes;
+            continue;
+        }
+        status = stageChunk(file, chunk);
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+        uint32_t bytes = chunk_size - offset;
+        if (bytes > count) {
+            bytes = count;
+        }
+        kmemcpy(iter, file->staging + offset, bytes);
+        iter += bytes;
+        file->position += bytes;
+        *count_read += bytes;
+        count -= bytes;
+    }
+    return SKNY_STATUS_OK;
+}
+
+// An inline file about to outgrow its entry. What it has becomes the
+// staged first chunk, which gets allocated along with the rest of the
+// write that's growing it.
+static void spillInlineData(SknyFile* file) {
+    kmemset(file->staging, 0, chunkSize(file->handle));
+    kmemcpy(file->staging, file->metadata.inline_data, file->metadata.size);
+    file->staged_chunk = 0;
+    file->staging_dirty = true;
+    // No extents yet
+    kmemset(file->metadata.inline_data, 0, INLINE_DATA_SIZE);
+    file->metadata.flags &= ~FILE_INLINE;
+    file->metadata_dirty = true;
+}
+
+// Puts things back if the chunk never got allocated after all
+static void unspillInlineData(SknyFile* file) {
+    kmemcpy(file->metadata.inline_data, file->staging, file->metadata.size);
+    file->metadata.flags |= FILE_INLINE;
+    file->staged_chunk = NO_CHUNK;
+    file->staging_dirty = false;
+}
+
+SknyStatus sknyWrite(SknyFile* file, const void* data, uint32_t count) {
+    const uint8_t* iter = (const uint8_t*) data;
+    uint32_t chunk_size = chunkSize(file->handle);
+    
+    uint32_t end = file->position + count;
+    bool spilled = false;
+    if (file->metadata.flags & FILE_INLINE) {
+        if (end <= INLINE_DATA_SIZE) {
+            // The data goes out with the entry on the next flush
+            kmemcpy(file->metadata.inline_data + file->position, iter, count);
+            file->position = end;
+            if (end > file->metadata.size) {
+                file->metadata.size = end;
+            }
+            file->metadata_dirty = true;
+            return SKNY_STATUS_OK;
+        }
+        spillInlineData(file);
+        spilled = true;
+    }
+    
+    // Make room for everything up front, so the extents are as long as
+    // they can be
+    uint32_t needed = (end + chunk_size - 1) / chunk_size;
+    uint32_t have = fileChunkCount(&file->metadata);
+    if (needed > have) {
+        // The new extents go into the same transaction as the chunks
+        // they claim, so a crash can't leave those chunks orphaned
+        SknyStatus status = journalReserve(file->handle, RESIZE_SECTORS(needed - have));
+        if (status == SKNY_STATUS_OK) {
+            status = growFile(file->handle, &file->metadata, needed - have);
+        }
+        if (status == SKNY_STATUS_OK) {
+            status = writeFileMetadata(file->handle, file->file_index, &file->metadata);
+        } else if (spilled) {
+            unspillInlineData(file);
+        }
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+    }
+    
+    while (count > 0) {
+        uint32_t chunk = file->position / chunk_size;
+        uint32_t offset = file->position % chunk_size;
+        SknyStatus status;
+        if (offset == 0 && count >= chunk_size) {
+            // Whole chunks skip the staging buffer. If it held one of
+            // them, it's about to be out of date.
+            uint32_t chunks = count / chunk_size;
+            if (file->staged_chunk >= chunk && file->staged_chunk < chunk + chunks) {
+                file->staged_chunk = NO_CHUNK;
+                file->staging_dirty = false;
+            }
+            status = transferChunks(file->handle, &file->metadata, chunk, chunks, (uint8_t*) iter, true);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+            uint32_t bytes = chunks * chunk_size;
+            iter += bytes;
+            file->position += bytes;
+            count -= bytes;
+        } else {
+            status = stageChunk(file, chunk);
+            if (status != SKNY_STATUS_OK) {
+                return status;
+            }
+            uint32_t bytes = chunk_size - offset;
+            if (bytes > count) {
+                bytes = count;
+            }
+            kmemcpy(file->staging + offset, iter, bytes);
+            file->staging_dirty = true;
+            iter += bytes;
+            file->position += bytes;
+            count -= bytes;
+        }
+        if (file->position > file->metadata.size) {
+            file->metadata.size = file->position;
+            file->metadata_dirty = true;
+        }
+    }
+    return SKNY_STATUS_OK;
+}
+
+SknyStatus sknySeek(SknyFile* file, uint32_t position) {
+    if (position > file->metadata.size) {
+        return SKNY_BAD_POSITION;
+    }
+    file->position = position;
+    return SKNY_STATUS_OK;
+}
+
+uint32_t sknyTell(SknyFile* file) {
+    return file->position;
 }
 
-SknyStatus sknyCreateFilesystem(SknyHandle* handle, uint8_t drive) {
+uint32_t sknyFileSize(SknyFile* file) {
+    return file->metadata.size;
+}
+
+SknyStatus sknyFlush(SknyFile* file) {
+    SknyStatus status = flushStaging(file);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    if (file->metadata_dirty) {
+        status = journalReserve(file->handle, 1);
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+        status = writeFileMetadata(file->handle, file->file_index, &file->metadata);
+        if (status != SKNY_STATUS_OK) {
+            return status;
+        }
+        file->metadata_dirty = false;
+    }
+    return SKNY_STATUS_OK;
+}
+
+SknyStatus sknyClose(SknyFile* file) {
+    SknyStatus status = sknyFlush(file);
+    kheapFree(file);
+    return status;
+}
+
+// Whether the layout makes sense and fits on the drive. Anything that
+// isn't a SknyFS superblock fails on the magic.
+static bool superblockValid(const SknySuperblock* superblock, uint8_t drive) {
+    uint32_t chunk_size = superblock->chunk_size;
+    if (superblock->magic != SUPERBLOCK_MAGIC || superblock->version != SUPERBLOCK_VERSION) {
+        return false;
+    }
+    if (chunk_size < IDE_SECTOR_SIZE || chunk_size > SKNY_MAX_CHUNK_SIZE || (chunk_size & (chunk_size - 1)) != 0) {
+        return false;
+    }
+    uint32_t sectors_per_chunk = chunk_size / IDE_SECTOR_SIZE;
+    return superblock->total_chunks <= ataDriveSectors(drive) / sectors_per_chunk
+        && superblock->total_chunks % BITS_PER_WORD == 0
+        && superblock->allocation_map_chunks <= SKNY_MAX_ALLOCATION_MAP_SIZE / chunk_size
+        && superblock->total_chunks <= superblock->allocation_map_chunks * chunk_size * 8
+        && superblock->file_map_chunks > 0
+        && superblock->journal_chunks * sectors_per_chunk >= JOURNAL_SECTORS
+        && superblock->allocation_map_start > 0
+        && superblock->allocation_map_start + superblock->allocation_map_chunks <= superblock->file_map_start
+        && superblock->file_map_start + superblock->file_map_chunks <= superblock->journal_start
+        && superblock->journal_start + superblock->journal_chunks <= superblock->data_start
+        && superblock->data_start < superblock->total_chunks;
+}
+
+static SknyStatus readSuperblock(SknyHandle* handle) {
+    uint8_t sector[IDE_SECTOR_SIZE];
+    if (!bcacheRead(handle->drive, 0, 1, sector)) {
+        return SKNY_READ_FAILURE;
+    }
+    SknySuperblock* superblock = kheapAlloc(sizeof(SknySuperblock));
+    kmemcpy(superblock, sector, sizeof(SknySuperblock));
+    if (!superblockValid(superblock, handle->drive)) {
+        kheapFree(superblock);
+        return SKNY_BAD_SUPERBLOCK;
+    }
+    handle->superblock = superblock;
+    return SKNY_STATUS_OK;
+}
+
+// Lets go of whatever the handle has allocated so far
+static void releaseHandle(SknyHandle* handle) {
+    if (handle->allocation_map != NULL) {
+        kheapFree(handle->allocation_map);
+    }
+    if (handle->committed_map != NULL) {
+        kheapFree(handle->committed_map);
+    }
+    if (handle->directory != NULL) {
+        kheapFree(handle->directory);
+    }
+    if (handle->journal != NULL) {
+        kheapFree(handle->journal);
+    }
+    if (handle->superblock != NULL) {
+        kheapFree(handle->superblock);
+    }
+    handle->allocation_map = NULL;
+    handle->committed_map = NULL;
+    handle->directory = NULL;
+    handle->journal = NULL;
+    handle->superblock = NULL;
+}
+
+SknyStatus sknyMount(SknyHandle* handle, uint8_t drive) {
+    handle->drive = drive;
+    handle->superblock = NULL;
+    handle->allocation_map = NULL;
+    handle->committed_map = NULL;
+    handle->next_fit = 0;
+    handle->directory = NULL;
+    handle->journal = NULL;
+    
+    SknyStatus status = readSuperblock(handle);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    SknySuperblock* superblock = handle->superblock;
+    handle->next_fit = superblock->data_start;
+    
+    uint32_t sequence;
+    status = journalReplay(handle, &sequence);
+    if (status != SKNY_STATUS_OK) {
+        releaseHandle(handle);
+        return status;
+    }
+    
+    // The maps are read whole, around the cache, which is left for the
+    // single sectors the journal changes later on
+    handle->allocation_map = kheapAlloc(allocationMapSize(handle));
+    SectorLocation sector = chunkToSector(handle, superblock->allocation_map_start);
+    status = transferSectors(handle, sector, chunkToSector(handle, superblock->allocation_map_chunks),
+                             (uint8_t*) handle->allocation_map, false);
+    if (status != SKNY_STATUS_OK) {
+        releaseHandle(handle);
+        return status;
+    }
+    handle->committed_map = kheapAlloc(allocationMapSize(handle));
+    kmemcpy(handle->committed_map, handle->allocation_map, allocationMapSize(handle));
+    
+    FileMetadata* files = kheapAlloc(superblock->file_map_chunks * chunkSize(handle));
+    sector = chunkToSector(handle, superblock->file_map_start);
+    status = transferSectors(handle, sector, chunkToSector(handle, superblock->file_map_chunks), (uint8_t*) files, false);
+    if (status != SKNY_STATUS_OK) {
+        kheapFree(files);
+        releaseHandle(handle);
+        return status;
+    }
+    handle->directory = directoryBuild(files, maximumFileCount(handle));
+    kheapFree(files);
+    handle->journal = journalCreate(sequence);
+    return SKNY_STATUS_OK;
+}
+
+SknyStatus sknySync(SknyHandle* handle) {
+    SknyStatus status = journalCommit(handle);
+    if (status != SKNY_STATUS_OK) {
+        return status;
+    }
+    if (!bcacheSync()) {
+        return SKNY_WRITE_FAILURE;
+    }
+    return SKNY_STATUS_OK;
+}
+
+SknyStatus sknyUnmount(SknyHandle* handle) {
+    SknyStatus status = sknySync(handle);
+    releaseHandle(handle);
+    return status;
+}
+
+void sknyDumpJournal(SknyHandle* handle) {
+    SknyJournal* journal = handle->journal;
+    kprintf("SknyFS journal: transaction %u, %u commits\n", journal->sequence, journal->commits);
+    kprintf("  Running: %u operations, %u of %u sectors\n",
+            journal->operations, journal->header.count, JOURNAL_MAX_ENTRIES);
+}
+
+static uint32_t chunksFor(uint32_t bytes, uint32_t chunk_size) {
+    return (bytes + chunk_size - 1) / chunk_size;
+}
+
+SknyStatus sknyCreateFilesystem(SknyHandle* handle, uint8_t drive, uint32_t chunk_size, uint32_t file_count) {
     handle->drive = drive;
+    handle->allocation_map = NULL;
+    handle->committed_map = NULL;
+    handle->directory = NULL;
+    handle->journal = NULL;
+    
+    //
+    // Lay out the disk: superblock in chunk 0, then the allocation map,
+    // the file map and the journal, then file data
+    //
+    SknySuperblock* superblock = kheapAlloc(sizeof(SknySuperblock));
+    kmemset(superblock, 0, sizeof(SknySuperblock));
+    handle->superblock = superblock;
+    superblock->magic = SUPERBLOCK_MAGIC;
+    superblock->version = SUPERBLOCK_VERSION;
+    superblock->chunk_size = chunk_size;
+    if (chunk_size < IDE_SECTOR_SIZE || chunk_size > SKNY_MAX_CHUNK_SIZE || (chunk_size & (chunk_size - 1)) != 0) {
+        releaseHandle(handle);
+        return SKNY_BAD_SUPERBLOCK;
+    }
+    // As much of the drive as the map can track, in whole words of it
+    uint32_t total_chunks = ataDriveSectors(drive) / (chunk_size / IDE_SECTOR_SIZE);
+    if (total_chunks > SKNY_MAX_ALLOCATION_MAP_SIZE * 8) {
+        total_chunks = SKNY_MAX_ALLOCATION_MAP_SIZE * 8;
+    }
+    superblock->total_chunks = total_chunks - (total_chunks % BITS_PER_WORD);
+    superblock->allocation_map_start = 1;
+    superblock->allocation_map_chunks = chunksFor(superblock->total_chunks / 8, chunk_size);
+    superblock->file_map_start = superblock->allocation_map_start + superblock->allocation_map_chunks;
+    superblock->file_map_chunks = chunksFor(file_count * sizeof(FileMetadata), chunk_size);
+    superblock->journal_start = superblock->file_map_start + superblock->file_map_chunks;
+    superblock->journal_chunks = chunksFor(JOURNAL_SECTORS * IDE_SECTOR_SIZE, chunk_size);
+    superblock->data_start = superblock->journal_start + superblock->journal_chunks;
+    if (!superblockValid(superblock, drive)) {
+        // The drive is too small for it
+        releaseHandle(handle);
+        return SKNY_BAD_SUPERBLOCK;
+    }
     
 #if INFORMATION_DUMP
     kprintf("=== INITIALIZING Skny FILESYSTEM... ===\n");
-    kprintf("Chunk size: %u bytes\n", CHUNK_SIZE);
-    kprintf("Allocation map: %u chunks\n", CHUNKS_IN_ALLOCATION_MAP);
-    kprintf("File map: %u chunks\n", CHUNKS_IN_FILE_MAP);
+    kprintf("Chunk size: %u bytes\n", chunk_size);
+    kprintf("Allocation map: %u chunks\n", superblock->allocation_map_chunks);
+    kprintf("File map: %u chunks\n", superblock->file_map_chunks);
+    kprintf("Journal: %u chunks\n", superblock->journal_chunks);
     kprintf("File metadata size: %u bytes\n", sizeof(FileMetadata));
-    kprintf("Total allocatable chunks: %u chunks\n", TOTAL_ALLOCATABLE_CHUNKS);
-    kprintf("Maximum file count: %u files\n", MAXIMUM_FILE_COUNT);
+    kprintf("Total allocatable chunks: %u chunks\n", superblock->total_chunks - superblock->data_start);
+    kprintf("Maximum file count: %u files\n", maximumFileCount(handle));
     
     kprintf("(!!!) FORMATTING TO Skny...\n");
-    kprintf("(!!!)   Formatting allocation map...\n");
 #endif
     
-    // Initialize allocation map
-    for (ChunkLocation i = 0; i < CHUNKS_IN_ALLOCATION_MAP; i++) {
-        ATAError write_err = clearChunk(handle, i, 0);
-        if (write_err != NoError) {
-            idePrintError(handle->drive, write_err);
-            return SKNY_WRITE_FAILURE;
-        }
+    //
+    // All the metadata goes out in one write that skips the cache, which
+    // would otherwise take it a sector at a time and push everything
+    // else out. The maps start out empty apart from the metadata chunks
+    // being in use, and an old journal left behind would be replayed
+    // over them, so the journal is zeroed too.
+    //
+    uint32_t metadata_bytes = superblock->data_start * chunk_size;
+    uint8_t* image = kheapAlloc(metadata_bytes);
+    kmemset(image, 0, metadata_bytes);
+    kmemcpy(image, superblock, sizeof(SknySuperblock));
+    
+    handle->allocation_map = kheapAlloc(allocationMapSize(handle));
+    kmemset(handle->allocation_map, 0, allocationMapSize(handle));
+    for (ChunkLocation chunk = 0; chunk < superblock->data_start; chunk++) {
+        handle->allocation_map[chunk / BITS_PER_WORD] |= 1u << (chunk % BITS_PER_WORD);
     }
+    kmemcpy(image + (superblock->allocation_map_start * chunk_size), handle->allocation_map, allocationMapSize(handle));
+    handle->committed_map = kheapAlloc(allocationMapSize(handle));
+    kmemcpy(handle->committed_map, handle->allocation_map, allocationMapSize(handle));
+    handle->next_fit = superblock->data_start;
     
-#if INFORMATION_DUMP
-    kprintf("(!!!)   Formatting file map...\n");
-#endif
+    const FileMetadata* files = (const FileMetadata*) (image + (superblock->file_map_start * chunk_size));
+    handle->directory = directoryBuild(files, maximumFileCount(handle));
+    handle->journal = journalCreate(1);
     
-    // Initialize file map
-    for (ChunkLocation i = 0; i < CHUNKS_IN_FILE_MAP; i++) {
-        ATAError write_err = clearChunk(handle, CHUNKS_IN_ALLOCATION_MAP + i, 0);
-        if (write_err != NoError) {
-            idePrintError(handle->drive, write_err);
-            return SKNY_WRITE_FAILURE;
-        }
+    uint32_t metadata_sectors = chunkToSector(handle, superblock->data_start);
+    bcacheInvalidate(drive, 0, metadata_sectors);
+    // The block layer takes its own copy
+    bool queued = blockWrite(drive, (const char*) image, 0, metadata_sectors);
+    kheapFree(image);
+    if (!queued) {
+        releaseHandle(handle);
+        return SKNY_WRITE_FAILURE;
+    }
+    
+    // Formatting should be on the disk before anyone relies on it
+    if (sknySync(handle) != SKNY_STATUS_OK) {
+        releaseHandle(handle);
+        return SKNY_WRITE_FAILURE;
     }
     
 #if INFORMATION_DUMP
@@ -297,3 +1387,41 @@ SknyStatus sknyCreateFilesystem(SknyHandle* handle, uint8_t drive) {
     
     return SKNY_STATUS_OK;
 }
+
+// Formats the drive and reports how long it took and how many commands
+// it cost. Wipes whatever filesystem was on the drive!
+void sknyFormatBenchmark(uint8_t drive, uint32_t chunk_size) {
+    if (!ataDrivePresent(drive)) {
+        kprintf("sknyFormatBenchmark: no drive %u\n", drive);
+        return;
+    }
+    PITResult counter = pitAddCounter();
+    if (counter.isError) {
+        kprintf("sknyFormatBenchmark couldn't get a PIT counter!\n");
+        return;
+    }
+    uint8_t counter_id = counter.counter_id;
+    BlockQueueStats before = blockGetStats(drive);
+    
+    SknyHandle handle;
+    SknyStatus status = sknyCreateFilesystem(&handle, drive, chunk_size, SKNY_DEFAULT_FILE_COUNT);
+    
+    uint32_t elapsed_millis = pitGetCounterCount(counter_id).count;
+    pitDeactivateCounter(counter_id);
+    BlockQueueStats after = blockGetStats(drive);
+    
+    kprintf("==== SknyFS FORMAT BENCHMARK ====\n");
+    if (status != SKNY_STATUS_OK) {
+        kprintf("Format failed: %s\n", sknyStatusToString(status));
+    }
+    kprintf("Time: %u ms\n", elapsed_millis);
+    kprintf("Commands: %u (%u sectors), flushes: %u\n",
+        after.dispatched - before.dispatched,
+        after.sectors_dispatched - before.sectors_dispatched,
+        after.flushes - before.flushes);
+    kprintf("=================================\n");
+    
+    if (status == SKNY_STATUS_OK) {
+        sknyUnmount(&handle);
+    }
+}
@@ -3,178 +3,364 @@
 #include <stdint.h>
 
 #include <kheap.h>
+#include <kslab.h>
 #include <kstdio.h>
 #include <kstdlib.h>
+#include <memory.h>
+#include <timer.h>
 
 #define KHEAP_MAGIC 0x7ea4
 
+// Every block in the heap is bracketed by a header (HeapNode) and a
+// footer (HeapFooter). These boundary tags let a block find both of
+// its physical neighbours in constant time, so freeing a block only
+// ever has to look at the blocks directly before and after it.
 typedef struct HeapNode {
     uint16_t magic_number;
+    bool allocated;
+    size_t size; // Size of the contents, not including the tags
+} HeapNode;
+
+typedef struct {
     size_t size;
-    struct HeapNode* next_node;
+    uint16_t magic_number;
     bool allocated;
-} __attribute__((packed)) HeapNode;
+} HeapFooter;
+
+// Free blocks don't need their contents, so the free list links are
+// kept in there instead
+typedef struct {
+    HeapNode* next_free;
+    HeapNode* prev_free;
+} FreeLinks;
+
+// Block contents are kept in multiples of this, so every allocation
+// comes back 8-byte aligned
+#define KHEAP_ALIGNMENT 8
+#define KHEAP_MIN_SIZE  sizeof(FreeLinks)
+#define KHEAP_TAGS_SIZE (sizeof(HeapNode) + sizeof(HeapFooter))
 
 #define NODE_TO_CONTENTS(ptr) (((HeapNode*) (ptr)) + 1)
 #define CONTENTS_TO_NODE(ptr) (((HeapNode*) (ptr)) - 1)
+#define NODE_TO_FOOTER(ptr)   ((HeapFooter*) (((uint8_t*) NODE_TO_CONTENTS(ptr)) + ((HeapNode*) (ptr))->size))
+#define NODE_TO_LINKS(ptr)    ((FreeLinks*) NODE_TO_CONTENTS(ptr))
+
+// Free blocks are binned by size: bin n holds blocks whose contents
+// are between 2^(n+3) and 2^(n+4) - 1 bytes. A bitmap of non-empty
+// bins lets allocation skip straight to the first bin that can
+// satisfy a request without touching any allocated blocks.
+#define KHEAP_BIN_COUNT 24
+#define KHEAP_BIN_SHIFT 3
+
+// The heap starts out empty and only has pages mapped in as far as
+// heap_end. It grows by at least KHEAP_GROW_MIN at a time, and gives
+// pages at the end back once KHEAP_TRIM_THRESHOLD of them are free, so
+// the two don't fight over the same few pages.
+#define KHEAP_GROW_MIN       (16 * 1024)
+#define KHEAP_TRIM_THRESHOLD (64 * 1024)
 
 static HeapNode* root_node;
+static uint8_t*  heap_end;
+static HeapNode* free_bins[KHEAP_BIN_COUNT];
+static uint32_t  nonempty_bins;
 
-void kheapInit() {
-    root_node = (HeapNode*) KHEAP_START;
-    root_node->magic_number = KHEAP_MAGIC;
-    root_node->size = (KHEAP_END - KHEAP_START) - sizeof(HeapNode);
-    root_node->next_node = NULL;
-    root_node->allocated = false;
+static size_t roundSize(size_t size) {
+    if (size < KHEAP_MIN_SIZE) {
+        size = KHEAP_MIN_SIZE;
+    }
+    return (size + KHEAP_ALIGNMENT - 1) & ~(KHEAP_ALIGNMENT - 1);
 }
 
-static HeapNode* createNode(void* place, size_t size, HeapNode* next, bool allocated) {
+static HeapNode* createNode(void* place, size_t size, bool allocated) {
     HeapNode* node = (HeapNode*) place;
     node->magic_number = KHEAP_MAGIC;
-    node->size = size;
-    node->next_node = next;
     node->allocated = allocated;
+    node->size = size;
+    HeapFooter* footer = NODE_TO_FOOTER(node);
+    footer->size = size;
+    footer->magic_number = KHEAP_MAGIC;
+    footer->allocated = allocated;
     return node;
 }
 
-static void compactHeap() {
-    HeapNode* iter = root_node;
-    while (iter != NULL) {
-        if (iter->next_node == NULL) {
-            break;
-        }
-        if (!iter->allocated && !iter->next_node->allocated) {
-            // Combine free space
-            iter->size += sizeof(HeapNode) + iter->next_node->size;
-            iter->next_node = iter->next_node->next_node;
-            continue;
-        }
-        iter = iter->next_node;
+static HeapNode* nextPhysicalNode(HeapNode* node) {
+    uint8_t* next = (uint8_t*) (NODE_TO_FOOTER(node) + 1);
+    if (next >= heap_end) {
+        return NULL;
     }
+    return (HeapNode*) next;
 }
 
-// Given a heap node with some empty, unaccounted-for space afterwards, either:
-//  a) Allocates a new node to manage this space with
-//  b) Consumes that space as part of this node, if there's not enough room for a new full node
-// You should run the heap compactor afterwards, to potentially
-// combine this new free space with what comes afterwards
-static void consumeEmptySpace(HeapNode* node) {
-    size_t unaccounted_space = ((uint8_t*) node->next_node) - ((uint8_t*) node) + node->size;
-    if (unaccounted_space > sizeof(HeapNode)) {
-        // Create a new node from this extra space
-        uint8_t* byte_ptr = ((uint8_t*) NODE_TO_CONTENTS(node)) + node->size;
-        HeapNode* new_node = createNode(
-                                        byte_ptr,
-                                        unaccounted_space - sizeof(HeapNode),
-                                        node->next_node,
-                                        false
-                                        );
-        // Rewrite current node
-        node->next_node = new_node;
-    } else {
-        // Add this extra bit of dangling space to our current heap node
-        node->size += unaccounted_space;
+static HeapNode* prevPhysicalNode(HeapNode* node) {
+    if (node == root_node) {
+        return NULL;
+    }
+    HeapFooter* prev_footer = ((HeapFooter*) node) - 1;
+    return (HeapNode*) (((uint8_t*) prev_footer) - prev_footer->size - sizeof(HeapNode));
+}
+
+static uint32_t sizeToBin(size_t size) {
+    // Index of the highest set bit, offset so KHEAP_MIN_SIZE is bin 0
+    uint32_t bin = (31 - __builtin_clz(size)) - KHEAP_BIN_SHIFT;
+    if (bin >= KHEAP_BIN_COUNT) {
+        bin = KHEAP_BIN_COUNT - 1;
     }
+    return bin;
 }
 
+static void freeListInsert(HeapNode* node) {
+    uint32_t bin = sizeToBin(node->size);
+    FreeLinks* links = NODE_TO_LINKS(node);
+    links->prev_free = NULL;
+    links->next_free = free_bins[bin];
+    if (free_bins[bin] != NULL) {
+        NODE_TO_LINKS(free_bins[bin])->prev_free = node;
+    }
+    free_bins[bin] = node;
+    nonempty_bins |= (1 << bin);
+}
 
+static void freeListRemove(HeapNode* node) {
+    uint32_t bin = sizeToBin(node->size);
+    FreeLinks* links = NODE_TO_LINKS(node);
+    if (links->prev_free != NULL) {
+        NODE_TO_LINKS(links->prev_free)->next_free = links->next_free;
+    } else {
+        free_bins[bin] = links->next_free;
+        if (free_bins[bin] == NULL) {
+            nonempty_bins &= ~(1 << bin);
+        }
+    }
+    if (links->next_free != NULL) {
+        NODE_TO_LINKS(links->next_free)->prev_free = links->prev_free;
+    }
+}
 
-void* __kheapAlloc(size_t size, bool first_time) {
-    // Locate free space
-    HeapNode* iter = root_node;
+// Finds the smallest free block in `bin` that can hold `size` bytes
+static HeapNode* bestFitInBin(uint32_t bin, size_t size) {
+    HeapNode* best = NULL;
+    HeapNode* iter = free_bins[bin];
     while (iter != NULL) {
-        if (iter->magic_number != KHEAP_MAGIC) {
-            if(!first_time){
-                kprintf("Kernel heap was corrupted!\n");
-                while (true);
-            }else {
-                // Could have been a page fault
-                if (root_node->magic_number != KHEAP_MAGIC){
-                    kheapInit();
-                }
-                
-                return __kheapAlloc(size, false);
-            }
+        if (iter->magic_number != KHEAP_MAGIC || iter->allocated) {
+            kprintf("Kernel heap was corrupted!\n");
+            while (true);
         }
-        
-        if (!iter->allocated && iter->size >= size) {
-            break;
+        if (iter->size >= size && (best == NULL || iter->size < best->size)) {
+            best = iter;
+            if (best->size == size) {
+                break;
+            }
         }
-        // Otherwise
-        iter = iter->next_node;
+        iter = NODE_TO_LINKS(iter)->next_free;
+    }
+    return best;
+}
+
+// Best fit among the free blocks: the bin `size` falls into may or may
+// not have a block big enough, but every block in a higher bin is, so
+// at most two bins are ever searched.
+static HeapNode* findFreeNode(size_t size) {
+    uint32_t bin = sizeToBin(size);
+    HeapNode* found = bestFitInBin(bin, size);
+    if (found != NULL) {
+        return found;
     }
+    uint32_t higher_bins = (bin + 1 < KHEAP_BIN_COUNT)
+        ? nonempty_bins & ~((1 << (bin + 1)) - 1) : 0;
+    if (higher_bins == 0) {
+        return NULL;
+    }
+    return bestFitInBin(__builtin_ctz(higher_bins), size);
+}
+
+// Marks a block as free, merges it with whichever of its physical
+// neighbours are also free and puts the result on the free list.
+static HeapNode* releaseNode(HeapNode* node) {
+    size_t size = node->size;
     
-    if (iter == NULL) {
+    HeapNode* next = nextPhysicalNode(node);
+    if (next != NULL && !next->allocated) {
+        freeListRemove(next);
+        size += KHEAP_TAGS_SIZE + next->size;
+    }
+    
+    HeapNode* prev = prevPhysicalNode(node);
+    if (prev != NULL && !prev->allocated) {
+        freeListRemove(prev);
+        size += KHEAP_TAGS_SIZE + prev->size;
+        node = prev;
+    }
+    
+    createNode(node, size, false);
+    freeListInsert(node);
+    return node;
+}
+
+// Shrinks an allocated block down to `size`, handing whatever is left
+// over back to the free pool. If the leftover space is too small to
+// hold a block of its own, it just stays part of this block.
+static void splitNode(HeapNode* node, size_t size) {
+    if (node->size < size + KHEAP_TAGS_SIZE + KHEAP_MIN_SIZE) {
+        return;
+    }
+    size_t remaining = node->size - size - KHEAP_TAGS_SIZE;
+    createNode(node, size, true);
+    HeapNode* rest = createNode(NODE_TO_FOOTER(node) + 1, remaining, true);
+    releaseNode(rest);
+}
+
+// Maps fresh pages onto the end of the heap, enough for a block with
+// `size` bytes of contents, and adds them to the free pool. If the
+// last block was free it absorbs the new space.
+static void growHeap(size_t size) {
+    size_t grow_size = (size + KHEAP_TAGS_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    size_t space_left = ((uint8_t*) KHEAP_SLAB_START) - heap_end;
+    if (grow_size > space_left) {
         // Didn't find any space!
         kprintf("Kernel heap ran out of space!\n");
         while (true);
     }
+    if (grow_size < KHEAP_GROW_MIN) {
+        grow_size = (space_left < KHEAP_GROW_MIN) ? space_left : KHEAP_GROW_MIN;
+    }
+    
+    for (size_t offset = 0; offset < grow_size; offset += PAGE_SIZE) {
+        mapFreshPage((uint32_t) (heap_end + offset));
+    }
+    HeapNode* node = createNode(heap_end, grow_size - KHEAP_TAGS_SIZE, true);
+    heap_end += grow_size;
+    releaseNode(node);
+}
+
+// If the free block `node` is the last one in the heap, and enough
+// whole pages at its end are unused, unmaps them and gives their
+// frames back.
+static void trimHeap(HeapNode* node) {
+    if (node->allocated || nextPhysicalNode(node) != NULL) {
+        return;
+    }
+    uint8_t* new_end;
+    if (((uintptr_t) node) % PAGE_SIZE == 0) {
+        // The whole block can go
+        new_end = (uint8_t*) node;
+    } else {
+        // Keep just enough for the block to stay a valid free block
+        uintptr_t minimum_end = ((uintptr_t) node) + KHEAP_TAGS_SIZE + KHEAP_MIN_SIZE;
+        new_end = (uint8_t*) ((minimum_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    }
+    if (heap_end - new_end < KHEAP_TRIM_THRESHOLD) {
+        return;
+    }
+    
+    freeListRemove(node);
+    if (new_end != (uint8_t*) node) {
+        createNode(node, new_end - ((uint8_t*) node) - KHEAP_TAGS_SIZE, false);
+        freeListInsert(node);
+    }
+    tlbBatchBegin();
+    for (uint8_t* page = new_end; page < heap_end; page += PAGE_SIZE) {
+        unmapPage((uint32_t) page);
+    }
+    tlbBatchEnd();
+    heap_end = new_end;
+}
+
+static void nodeHeapInit() {
+    // Nothing is mapped until the first allocation asks for it
+    root_node = (HeapNode*) KHEAP_START;
+    heap_end = (uint8_t*) KHEAP_START;
+    for (uint32_t i = 0; i < KHEAP_BIN_COUNT; i++) {
+        free_bins[i] = NULL;
+    }
+    nonempty_bins = 0;
+}
+
+void kheapInit() {
+    nodeHeapInit();
+    kslabInit();
+}
+
+static void* nodeAlloc(size_t size) {
+    size = roundSize(size);
     
-    iter->size = size;
-    iter->allocated = true;
+    // Locate free space, growing the heap if there isn't any
+    HeapNode* iter = findFreeNode(size);
+    if (iter == NULL) {
+        growHeap(size);
+        iter = findFreeNode(size);
+    }
     
-    consumeEmptySpace(iter);
-    compactHeap();
+    freeListRemove(iter);
+    createNode(iter, iter->size, true);
+    splitNode(iter, size);
     
     return NODE_TO_CONTENTS(iter);
 }
 
 void* kheapAlloc(size_t size){
-    return __kheapAlloc(size, true);
+    if (size <= KSLAB_MAX_OBJECT_SIZE) {
+        return kslabAlloc(size);
+    }
+    return nodeAlloc(size);
+}
+
+// Works out where an allocation aligned to `alignment` would start
+// inside the free block `node`, or returns 0 if it doesn't fit there
+static uintptr_t alignedPlacement(HeapNode* node, size_t size, size_t alignment) {
+    uintptr_t first_byte_addr = (uintptr_t) NODE_TO_CONTENTS(node);
+    uintptr_t aligned_addr = (first_byte_addr + alignment - 1) & ~(alignment - 1);
+    // Any padding in front of the allocation has to be big enough to
+    // become a free block of its own
+    while (aligned_addr != first_byte_addr
+           && aligned_addr - first_byte_addr < KHEAP_TAGS_SIZE + KHEAP_MIN_SIZE) {
+        aligned_addr += alignment;
+    }
+    if ((aligned_addr - first_byte_addr) + size > node->size) {
+        return 0;
+    }
+    return aligned_addr;
 }
 
 void* kheapAlignedAlloc(size_t size, size_t alignment) {
-    HeapNode* iter = root_node;
-    HeapNode* chosen;
-    while (iter != NULL) {
-        if (iter->magic_number != KHEAP_MAGIC) {
-            kprintf("Kernel heap was corrupted!\n");
-            while (true);
-        }
-        // Is this node a candidate for allocation?
-        if (!iter->allocated && iter->size >= sizeof(HeapNode) + size) {
-            uintptr_t first_byte_addr = (uintptr_t) NODE_TO_CONTENTS(iter);
-            uintptr_t offset = alignment - (first_byte_addr % alignment);
-            if (offset == alignment) {
-                // If we're already on a boundary, don't offset
-                offset = 0;
-            }
-            kprintf("offset: %u, alignment: %u, first_byte_addr: %x\n", offset, alignment, first_byte_addr);
-            if (iter->size - offset < sizeof(HeapNode) + size) {
-                // Not enough room when accounting for offset!
-                iter = iter->next_node;
-                continue;
-            }
-            chosen = (HeapNode*) (first_byte_addr + offset);
-            break;
-        }
-        // Otherwise
-        iter = iter->next_node;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        kprintf("kheapAlignedAlloc needs a power of two alignment!\n");
+        while (true);
+    }
+    if (alignment <= KHEAP_ALIGNMENT) {
+        // Every allocation is already aligned this much
+        return kheapAlloc(size);
     }
+    size = roundSize(size);
     
-    if (iter == NULL) {
-        // Didn't find any space!
-        kprintf("Kernel heap ran out of space!\n");
-        while (true);
+    // A best fit block might happen to be suitably aligned already
+    HeapNode* iter = findFreeNode(size);
+    uintptr_t chosen_addr = (iter != NULL) ? alignedPlacement(iter, size, alignment) : 0;
+    if (chosen_addr == 0) {
+        // Otherwise ask for a block with room for the worst case
+        // padding, which is guaranteed to fit
+        size_t padded_size = size + alignment + KHEAP_TAGS_SIZE + KHEAP_MIN_SIZE;
+        iter = findFreeNode(padded_size);
+        if (iter == NULL) {
+            growHeap(padded_size);
+            iter = findFreeNode(padded_size);
+        }
+        chosen_addr = alignedPlacement(iter, size, alignment);
     }
     
     // Allocate!
-    HeapNode* preceding_node = iter;
-    // - Brooke Tilley, 20:27 Wednesday 23 June 2021 -
-    //   `chosen` is guaranteed to start after the end of preceding_node's header
-    //   So there's a chance that preceding_node is left with zero remaining space
-    //   This is fine, it's not allocated anyway so it should get cleaned up by the heap compactor
-    createNode(
-               chosen,
-               size,
-               preceding_node->next_node,
-               true
-               );
-    preceding_node->size = ((size_t) (((uint8_t*) chosen) - ((uint8_t*) preceding_node))) - sizeof(HeapNode);
-    preceding_node->next_node = chosen;
-    
-    consumeEmptySpace(chosen);
-    compactHeap();
+    freeListRemove(iter);
+    HeapNode* chosen = CONTENTS_TO_NODE(chosen_addr);
+    if (chosen != iter) {
+        // Give the padding in front back to the free pool
+        size_t padding_size = ((uint8_t*) chosen) - ((uint8_t*) NODE_TO_CONTENTS(iter)) - sizeof(HeapFooter);
+        size_t chosen_size = iter->size - padding_size - KHEAP_TAGS_SIZE;
+        createNode(iter, padding_size, true);
+        createNode(chosen, chosen_size, true);
+        releaseNode(iter);
+    } else {
+        createNode(chosen, chosen->size, true);
+    }
+    splitNode(chosen, size);
     
     return NODE_TO_CONTENTS(chosen);
 }
@@ -188,65 +374,43 @@ void* kheapRealloc(void* ptr, size_t size) {
         return NULL;
     }
     
+    if (kslabOwns(ptr)) {
+        // Case: Slab objects can't grow in place, but anything that
+        // still fits in the object's size class can stay put
+        size_t object_size = kslabObjectSize(ptr);
+        if (size <= object_size) {
+            return ptr;
+        }
+        void* new_ptr = kheapAlloc(size);
+        kmemcpy(new_ptr, ptr, object_size);
+        kslabFree(ptr);
+        return new_ptr;
+    }
+    
     HeapNode* current_node = CONTENTS_TO_NODE(ptr);
-    if (current_node->magic_number != KHEAP_MAGIC) {
+    if (current_node->magic_number != KHEAP_MAGIC || !current_node->allocated) {
         kprintf("Passed bad pointer to kheapRealloc!\n");
         while (true);
     }
-    if (size == current_node->size) {
-        // Case: Don't do anything if you're reallocating to the same size
+    size = roundSize(size);
+    if (size <= current_node->size) {
+        // Case: Shrink in place, returning the tail to the free pool
+        // if it's big enough to be useful
+        splitNode(current_node, size);
+        HeapNode* rest = nextPhysicalNode(current_node);
+        if (rest != NULL) {
+            trimHeap(rest);
+        }
         return ptr;
     }
-    if (size < current_node->size) {
-        // Case: Resize the current node if you're reallocating to a smaller size
-        size_t size_delta = current_node->size - size;
-        if (size_delta >= sizeof(HeapNode) + 1) {
-            // If there's enough room, fill the space with a new, unallocated node
-            HeapNode* new_node = createNode(
-                                            NODE_TO_CONTENTS(current_node) + size,
-                                            size_delta - sizeof(HeapNode),
-                                            current_node->next_node,
-                                            false
-                                            );
-            
-            current_node->next_node = new_node;
-            current_node->size = size;
-            
-            compactHeap();
-        }
-        // Otherwise, don't even bother resizing. We can't do anything with the space it would free.
-        return NODE_TO_CONTENTS(current_node);
-    }
-    size_t possible_size = 0;
-    HeapNode* iter = current_node->next_node;
-    while (iter != NULL && !iter->allocated) {
-        possible_size += sizeof(HeapNode) + iter->size;
-        iter = iter->next_node;
-    }
-    if (size <= possible_size) {
-        // Case: Expand the current space if there's enough empty unallocated space afterwards
-        size_t size_delta = possible_size - size;
-        if (size_delta >= sizeof(HeapNode) + 1) {
-            // Create a new node out of the extra space
-            HeapNode* new_node = createNode(
-                                            NODE_TO_CONTENTS(current_node) + size,
-                                            size_delta - sizeof(HeapNode),
-                                            iter,
-                                            false
-                                            );
-            
-            current_node->next_node = new_node;
-            current_node->size = size;
-            
-            compactHeap();
-            
-            return NODE_TO_CONTENTS(current_node);
-        } else {
-            // Consume the extra space - it's not big enough to be useful
-            current_node->next_node = iter;
-            current_node->size = possible_size;
-            return NODE_TO_CONTENTS(current_node);
-        }
+    HeapNode* next = nextPhysicalNode(current_node);
+    if (next != NULL && !next->allocated
+        && current_node->size + KHEAP_TAGS_SIZE + next->size >= size) {
+        // Case: Expand in place by swallowing the free block afterwards
+        freeListRemove(next);
+        createNode(current_node, current_node->size + KHEAP_TAGS_SIZE + next->size, true);
+        splitNode(current_node, size);
+        return ptr;
     }
     // Case: No optimization possible, just do the naive thing
     void* new_ptr = kheapAlloc(size);
@@ -255,20 +419,114 @@ void* kheapRealloc(void* ptr, size_t size) {
     return new_ptr;
 }
 
-void kheapFree(void* ptr) {
+static void nodeFree(void* ptr) {
     HeapNode* node = CONTENTS_TO_NODE(ptr);
-    if (node->magic_number != KHEAP_MAGIC) {
+    if (node->magic_number != KHEAP_MAGIC || !node->allocated) {
         kprintf("Passed bad pointer to kheapFree!\n");
         while (true);
     }
-    node->allocated = false;
-    compactHeap();
+    trimHeap(releaseNode(node));
+}
+
+void kheapFree(void* ptr) {
+    if (kslabOwns(ptr)) {
+        kslabFree(ptr);
+        return;
+    }
+    nodeFree(ptr);
 }
 
 void kheapDump() {
-    HeapNode* iter = root_node;
+    size_t free_total = 0;
+    size_t free_largest = 0;
+    uint32_t free_count = 0;
+    uint32_t used_count = 0;
+    HeapNode* iter = (heap_end != (uint8_t*) root_node) ? root_node : NULL;
     while (iter != NULL) {
-        kprintf("Node (%x):\n  Magic: %x\n  Next: %x\n  Size: %u\n  Alloc: %s\n", iter, iter->magic_number, iter->next_node, iter->size, iter->allocated ? "yes" : "no");
-        iter = iter->next_node;
+        kprintf("Node (%x):\n  Magic: %x\n  Size: %u\n  Alloc: %s\n", iter, iter->magic_number, iter->size, iter->allocated ? "yes" : "no");
+        if (iter->allocated) {
+            used_count++;
+        } else {
+            free_count++;
+            free_total += iter->size;
+            if (iter->size > free_largest) {
+                free_largest = iter->size;
+            }
+        }
+        iter = nextPhysicalNode(iter);
+    }
+    
+    kprintf("Free bins:\n");
+    for (uint32_t bin = 0; bin < KHEAP_BIN_COUNT; bin++) {
+        uint32_t count = 0;
+        for (HeapNode* node = free_bins[bin]; node != NULL; node = NODE_TO_LINKS(node)->next_free) {
+            count++;
+        }
+        if (count != 0) {
+            kprintf("  >= %u bytes: %u blocks\n", 1 << (bin + KHEAP_BIN_SHIFT), count);
+        }
+    }
+    
+    // External fragmentation: how much of the free space can't be
+    // handed out as a single allocation
+    uint32_t fragmentation = (free_total == 0)
+        ? 0 : 100 - ((free_largest * 100) / free_total);
+    kprintf("Blocks: %u used, %u free\n", used_count, free_count);
+    kprintf("Free: %u bytes, largest free block: %u bytes\n", free_total, free_largest);
+    kprintf("Fragmentation: %u percent\n", fragmentation);
+    kprintf("Heap mapped: %u bytes\n", heap_end - ((uint8_t*) root_node));
+    kslabDump();
+}
+
+#define KHEAP_BENCHMARK_ITERATIONS 10000
+#define KHEAP_BENCHMARK_LIVE       64
+
+// Times KHEAP_BENCHMARK_ITERATIONS alloc/free pairs against a backdrop
+// of KHEAP_BENCHMARK_LIVE live allocations, so the allocator under
+// test can't get away with an empty heap. Returns allocations/sec.
+static uint32_t benchmarkAllocator(void* (*alloc)(size_t), void (*free)(void*), size_t size) {
+    void* live[KHEAP_BENCHMARK_LIVE];
+    for (uint32_t i = 0; i < KHEAP_BENCHMARK_LIVE; i++) {
+        live[i] = alloc(size);
+    }
+    
+    PITResult counter = pitAddCounter();
+    if (counter.isError) {
+        kprintf("kheapBenchmark couldn't get a PIT counter!\n");
+        return 0;
+    }
+    uint8_t counter_id = counter.counter_id;
+    
+    for (uint32_t i = 0; i < KHEAP_BENCHMARK_ITERATIONS; i++) {
+        uint32_t slot = i % KHEAP_BENCHMARK_LIVE;
+        free(live[slot]);
+        live[slot] = alloc(size);
+    }
+    
+    uint32_t elapsed_millis = pitGetCounterCount(counter_id).count;
+    pitDeactivateCounter(counter_id);
+    
+    for (uint32_t i = 0; i < KHEAP_BENCHMARK_LIVE; i++) {
+        free(live[i]);
+    }
+    
+    if (elapsed_millis == 0) {
+        // Faster than the PIT can resolve, round up to one tick
+        elapsed_millis = 1;
+    }
+    return (KHEAP_BENCHMARK_ITERATIONS * 1000) / elapsed_millis;
+}
+
+// Compares the plain heap node list against the slab caches for a
+// handful of small allocation sizes
+void kheapBenchmark() {
+    static const size_t sizes[] = { 16, 64, 256, 1024, 2048 };
+    kprintf("==== KHEAP BENCHMARK ====\n");
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t node_rate = benchmarkAllocator(nodeAlloc, nodeFree, sizes[i]);
+        uint32_t slab_rate = benchmarkAllocator(kslabAlloc, kslabFree, sizes[i]);
+        kprintf("%u bytes: node list %u allocs/sec, slab %u allocs/sec\n",
+                sizes[i], node_rate, slab_rate);
     }
+    kprintf("=========================\n");
 }
@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kheap.h>
+#include <kslab.h>
+#include <kstdio.h>
+#include <memory.h>
+
+#define SLAB_MAGIC 0x51ab
+
+// Every slab is a naturally aligned SLAB_SIZE block, so the slab
+// header for any object can be found by masking off the low bits of
+// its address.
+#define SLAB_SIZE (16 * 1024)
+
+// Size classes are the powers of two from KSLAB_MIN_OBJECT_SIZE up to
+// KSLAB_MAX_OBJECT_SIZE: 16, 32, 64, 128, 256, 512, 1024, 2048
+#define SLAB_CLASS_COUNT 8
+
+typedef struct SlabObject {
+    struct SlabObject* next;
+} SlabObject;
+
+typedef struct Slab {
+    uint16_t magic_number;
+    uint16_t class_index;
+    uint16_t in_use;
+    uint16_t capacity;
+    // Objects that were handed out and then freed again
+    SlabObject* free_list;
+    // Objects past this point have never been handed out. Carving
+    // them lazily means setting up a fresh slab is O(1).
+    uint8_t* unused;
+    // Links in the owning cache's partial list
+    struct Slab* next;
+    struct Slab* prev;
+} Slab;
+
+// Objects start after the header, rounded so every object is at
+// least 16 byte aligned.
+#define SLAB_OBJECTS_OFFSET ((sizeof(Slab) + 15) & ~15)
+
+#define SLAB_OF(ptr) ((Slab*) (((uintptr_t) (ptr)) & ~(SLAB_SIZE - 1)))
+
+typedef struct {
+    size_t object_size;
+    // Slabs with at least one free object. Full slabs aren't tracked
+    // at all; they rejoin this list when one of their objects is freed.
+    Slab* partial;
+    uint32_t slab_count;
+} SlabCache;
+
+static SlabCache caches[SLAB_CLASS_COUNT];
+
+// Slabs that were emptied out and returned, ready to be reused by
+// any size class. Their pages are given back to the frame allocator,
+// so the addresses are kept here rather than in the slabs themselves.
+#define SLAB_REGION_COUNT ((KHEAP_END + 1 - KHEAP_SLAB_START) / SLAB_SIZE)
+static uintptr_t free_slabs[SLAB_REGION_COUNT];
+static uint32_t free_slab_count;
+// Start of the part of the slab region that has never been used
+static uintptr_t slab_break;
+
+void kslabInit() {
+    size_t object_size = KSLAB_MIN_OBJECT_SIZE;
+    for (uint32_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        caches[i].object_size = object_size;
+        caches[i].partial = NULL;
+        caches[i].slab_count = 0;
+        object_size *= 2;
+    }
+    free_slab_count = 0;
+    slab_break = KHEAP_SLAB_START;
+}
+
+static uint32_t sizeToClass(size_t size) {
+    uint32_t class_index = 0;
+    while (caches[class_index].object_size < size) {
+        class_index++;
+    }
+    return class_index;
+}
+
+static void pushPartial(SlabCache* cache, Slab* slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial != NULL) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+static void removePartial(SlabCache* cache, Slab* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static Slab* createSlab(uint32_t class_index) {
+    Slab* slab;
+    if (free_slab_count != 0) {
+        free_slab_count--;
+        slab = (Slab*) free_slabs[free_slab_count];
+    } else {
+        if (slab_break + SLAB_SIZE > ((uintptr_t) KHEAP_END) + 1) {
+            kprintf("Kernel heap ran out of slab space!\n");
+            while (true);
+        }
+        slab = (Slab*) slab_break;
+        slab_break += SLAB_SIZE;
+    }
+    for (uintptr_t page = (uintptr_t) slab; page < ((uintptr_t) slab) + SLAB_SIZE; page += PAGE_SIZE) {
+        mapFreshPage(page);
+    }
+    size_t object_size = caches[class_index].object_size;
+    slab->magic_number = SLAB_MAGIC;
+    slab->class_index = class_index;
+    slab->in_use = 0;
+    slab->capacity = (SLAB_SIZE - SLAB_OBJECTS_OFFSET) / object_size;
+    slab->free_list = NULL;
+    slab->unused = ((uint8_t*) slab) + SLAB_OBJECTS_OFFSET;
+    slab->next = NULL;
+    slab->prev = NULL;
+    caches[class_index].slab_count++;
+    return slab;
+}
+
+static void releaseSlab(Slab* slab) {
+    caches[slab->class_index].slab_count--;
+    slab->magic_number = 0;
+    tlbBatchBegin();
+    for (uintptr_t page = (uintptr_t) slab; page < ((uintptr_t) slab) + SLAB_SIZE; page += PAGE_SIZE) {
+        unmapPage(page);
+    }
+    tlbBatchEnd();
+    free_slabs[free_slab_count] = (uintptr_t) slab;
+    free_slab_count++;
+}
+
+void* kslabAlloc(size_t size) {
+    uint32_t class_index = sizeToClass(size);
+    SlabCache* cache = &caches[class_index];
+
+    Slab* slab = cache->partial;
+    if (slab == NULL) {
+        slab = createSlab(class_index);
+        pushPartial(cache, slab);
+    }
+
+    void* object;
+    if (slab->free_list != NULL) {
+        object = slab->free_list;
+        slab->free_list = slab->free_list->next;
+    } else {
+        object = slab->unused;
+        slab->unused += cache->object_size;
+    }
+
+    slab->in_use++;
+    if (slab->in_use == slab->capacity) {
+        removePartial(cache, slab);
+    }
+    return object;
+}
+
+void kslabFree(void* ptr) {
+    Slab* slab = SLAB_OF(ptr);
+    if (slab->magic_number != SLAB_MAGIC) {
+        kprintf("Passed bad pointer to kheapFree!\n");
+        while (true);
+    }
+    SlabCache* cache = &caches[slab->class_index];
+
+    SlabObject* object = (SlabObject*) ptr;
+    object->next = slab->free_list;
+    slab->free_list = object;
+
+    if (slab->in_use == slab->capacity) {
+        // Slab was full, so it's not on the partial list yet
+        pushPartial(cache, slab);
+    }
+    slab->in_use--;
+
+    // Hand empty slabs back, but always keep at least one around per
+    // class so alloc/free of a single object doesn't thrash
+    if (slab->in_use == 0 && (slab->next != NULL || slab->prev != NULL)) {
+        removePartial(cache, slab);
+        releaseSlab(slab);
+    }
+}
+
+bool kslabOwns(void* ptr) {
+    uintptr_t address = (uintptr_t) ptr;
+    return address >= KHEAP_SLAB_START && address <= KHEAP_END;
+}
+
+size_t kslabObjectSize(void* ptr) {
+    Slab* slab = SLAB_OF(ptr);
+    return caches[slab->class_index].object_size;
+}
+
+void kslabDump() {
+    for (uint32_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (caches[i].slab_count == 0) {
+            continue;
+        }
+        kprintf("Slab cache %u bytes: %u slabs\n", caches[i].object_size, caches[i].slab_count);
+    }
+    kprintf("Slab region used: %u bytes\n", slab_break - KHEAP_SLAB_START);
+}